@@ -14,6 +14,13 @@ extern "C" {
 
 #define EPOLL_CLOEXEC O_CLOEXEC
 
+/*
+ * epoll-shim extension: EPOLL_CTL_MOD/EPOLL_CTL_DEL changes that cannot fail
+ * and only remove or disable filters are queued and applied with the kevent()
+ * call of the next epoll_wait().
+ */
+#define EPOLL_SHIM_DEFER_CTL 0x40000000
+
 enum EPOLL_EVENTS { __EPOLL_DUMMY };
 #define EPOLLIN 0x001
 #define EPOLLPRI 0x002
@@ -59,6 +66,28 @@ int epoll_ctl(int, int, int, struct epoll_event *);
 int epoll_wait(int, struct epoll_event *, int, int);
 int epoll_pwait(int, struct epoll_event *, int, int, sigset_t const *);
 
+/*
+ * Applies 'n' epoll_ctl operations with a single kevent() call where
+ * possible. The result of each operation is stored in its 'error' member
+ * (0 or an errno value). Returns the number of failed operations, or -1 if
+ * the batch as a whole could not be processed.
+ */
+struct epoll_shim_ctl_op {
+	int op;
+	int fd;
+	struct epoll_event event;
+	int error;
+};
+
+int epoll_shim_ctl_batch(int, struct epoll_shim_ctl_op *, int);
+
+/*
+ * Lets the deadlines of epoll_wait() timeouts on an epoll fd, or of a
+ * timerfd's expirations, be delayed to the next multiple of 'slack' (in
+ * nanoseconds) so that nearby wakeups are coalesced. 0 disables this.
+ */
+int epoll_shim_set_timer_slack(int, long);
+
 
 #ifndef EPOLL_SHIM_DISABLE_WRAPPER_MACROS
 #include <epoll-shim/detail/common.h>
@@ -20,6 +20,9 @@ int timerfd_create(int, int);
 int timerfd_settime(int, int, struct itimerspec const *, struct itimerspec *);
 int timerfd_gettime(int, struct itimerspec *);
 
+/* See <sys/epoll.h>. */
+int epoll_shim_set_timer_slack(int, long);
+
 
 #ifndef EPOLL_SHIM_DISABLE_WRAPPER_MACROS
 #include <epoll-shim/detail/common.h>
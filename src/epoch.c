@@ -0,0 +1,234 @@
+#include "epoch.h"
+
+#include <assert.h>
+
+/*
+ * Classic three epoch scheme: an object retired in epoch 'e' may still be
+ * seen by readers that entered in 'e' or earlier. The global epoch can only
+ * advance once all active readers have observed the current one, so after
+ * two advances those readers are gone.
+ */
+
+#define EPOCH_ACTIVE 1U
+
+struct epoch_record_ {
+	_Alignas(64) atomic_uint_fast64_t epoch;
+	atomic_bool in_use;
+	unsigned int nesting;
+	EpochRecord *next;
+};
+
+static void
+epoch_record_release(void *arg)
+{
+	EpochRecord *record = arg;
+
+	record->nesting = 0;
+	atomic_store_explicit(&record->epoch, 0, memory_order_release);
+	atomic_store_explicit(&record->in_use, false, memory_order_release);
+}
+
+errno_t
+epoch_domain_init(EpochDomain *domain)
+{
+	errno_t ec;
+
+	*domain = (EpochDomain) {};
+
+	if ((ec = pthread_mutex_init(&domain->mutex, NULL)) != 0) {
+		goto out_mutex;
+	}
+
+	if ((ec = pthread_key_create(&domain->record_key,
+		 epoch_record_release)) != 0) {
+		goto out_record_key;
+	}
+
+	return 0;
+
+	(void)pthread_key_delete(domain->record_key);
+out_record_key:
+	(void)pthread_mutex_destroy(&domain->mutex);
+out_mutex:
+	return ec;
+}
+
+void
+epoch_domain_terminate(EpochDomain *domain)
+{
+	assert(atomic_load(&domain->nr_fallback_readers) == 0);
+
+	EpochEntry *entry = domain->retired;
+	while (entry) {
+		EpochEntry *next = entry->next;
+		entry->destroy_fun(entry);
+		entry = next;
+	}
+
+	EpochRecord *record = atomic_load(&domain->records);
+	while (record) {
+		EpochRecord *next = record->next;
+		assert(!(atomic_load(&record->epoch) & EPOCH_ACTIVE));
+		free(record);
+		record = next;
+	}
+
+	(void)pthread_key_delete(domain->record_key);
+	(void)pthread_mutex_destroy(&domain->mutex);
+}
+
+static EpochRecord *
+epoch_record_acquire(EpochDomain *domain)
+{
+	EpochRecord *record;
+
+	for (record = atomic_load(&domain->records); record;
+	     record = record->next) {
+		bool expected = false;
+		if (!atomic_load_explicit(&record->in_use,
+			memory_order_relaxed) &&
+		    atomic_compare_exchange_strong(&record->in_use, &expected,
+			true)) {
+			break;
+		}
+	}
+
+	if (!record) {
+		void *mem;
+		if (posix_memalign(&mem, _Alignof(EpochRecord),
+			sizeof(EpochRecord)) != 0) {
+			return NULL;
+		}
+
+		record = mem;
+		atomic_init(&record->epoch, 0);
+		atomic_init(&record->in_use, true);
+		record->nesting = 0;
+
+		/* Records are never freed, only reused. */
+		record->next = atomic_load(&domain->records);
+		while (!atomic_compare_exchange_weak(&domain->records,
+		    &record->next, record)) {
+		}
+	}
+
+	if (pthread_setspecific(domain->record_key, record) != 0) {
+		epoch_record_release(record);
+		return NULL;
+	}
+
+	return record;
+}
+
+EpochRecord *
+epoch_enter(EpochDomain *domain)
+{
+	EpochRecord *record = pthread_getspecific(domain->record_key);
+	if (!record && !(record = epoch_record_acquire(domain))) {
+		/* This blocks reclamation until the reader is gone. */
+		atomic_fetch_add(&domain->nr_fallback_readers, 1);
+		return NULL;
+	}
+
+	if (record->nesting++ == 0) {
+		uint_fast64_t epoch = atomic_load_explicit(&domain->global_epoch,
+		    memory_order_relaxed);
+		atomic_store_explicit(&record->epoch,
+		    (epoch << 1) | EPOCH_ACTIVE, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	return record;
+}
+
+void
+epoch_exit(EpochDomain *domain, EpochRecord *record)
+{
+	if (!record) {
+		atomic_fetch_sub_explicit(&domain->nr_fallback_readers, 1,
+		    memory_order_release);
+		return;
+	}
+
+	assert(record->nesting > 0);
+
+	if (--record->nesting == 0) {
+		atomic_store_explicit(&record->epoch, 0, memory_order_release);
+	}
+}
+
+static bool
+epoch_try_advance(EpochDomain *domain)
+{
+	uint_fast64_t epoch = atomic_load_explicit(&domain->global_epoch,
+	    memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&domain->nr_fallback_readers,
+		memory_order_acquire) != 0) {
+		return false;
+	}
+
+	for (EpochRecord *record = atomic_load(&domain->records); record;
+	     record = record->next) {
+		uint_fast64_t record_epoch = atomic_load_explicit(
+		    &record->epoch, memory_order_acquire);
+		if ((record_epoch & EPOCH_ACTIVE) &&
+		    (record_epoch >> 1) != epoch) {
+			return false;
+		}
+	}
+
+	atomic_store_explicit(&domain->global_epoch, epoch + 1,
+	    memory_order_release);
+	return true;
+}
+
+void
+epoch_reclaim(EpochDomain *domain)
+{
+	EpochEntry *reclaimable = NULL;
+
+	(void)pthread_mutex_lock(&domain->mutex);
+	if (domain->retired) {
+		if (epoch_try_advance(domain)) {
+			(void)epoch_try_advance(domain);
+		}
+
+		uint_fast64_t epoch = atomic_load_explicit(&domain->global_epoch,
+		    memory_order_relaxed);
+
+		/* The list is sorted by epoch, newest first. */
+		EpochEntry **entry = &domain->retired;
+		while (*entry && (*entry)->epoch + 2 > epoch) {
+			entry = &(*entry)->next;
+		}
+		reclaimable = *entry;
+		*entry = NULL;
+	}
+	(void)pthread_mutex_unlock(&domain->mutex);
+
+	while (reclaimable) {
+		EpochEntry *next = reclaimable->next;
+		reclaimable->destroy_fun(reclaimable);
+		reclaimable = next;
+	}
+}
+
+void
+epoch_retire(EpochDomain *domain, EpochEntry *entry,
+    void (*destroy_fun)(EpochEntry *entry))
+{
+	entry->destroy_fun = destroy_fun;
+
+	(void)pthread_mutex_lock(&domain->mutex);
+	atomic_thread_fence(memory_order_seq_cst);
+	entry->epoch = atomic_load_explicit(&domain->global_epoch,
+	    memory_order_relaxed);
+	entry->next = domain->retired;
+	domain->retired = entry;
+	(void)pthread_mutex_unlock(&domain->mutex);
+
+	epoch_reclaim(domain);
+}
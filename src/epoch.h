@@ -0,0 +1,50 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/*
+ * Epoch based reclamation. Readers bracket their accesses to shared data
+ * with epoch_enter()/epoch_exit(), which only write to a per-thread
+ * record. Objects that have been unlinked are handed to epoch_retire()
+ * and are destroyed once no reader can still see them.
+ */
+
+typedef struct epoch_entry_ {
+	struct epoch_entry_ *next;
+	uint_fast64_t epoch;
+	void (*destroy_fun)(struct epoch_entry_ *entry);
+} EpochEntry;
+
+typedef struct epoch_record_ EpochRecord;
+
+typedef struct {
+	atomic_uint_fast64_t global_epoch;
+	EpochRecord *_Atomic records;
+	pthread_key_t record_key;
+
+	/* Readers that could not get a record of their own. */
+	atomic_uint nr_fallback_readers;
+
+	pthread_mutex_t mutex;
+	EpochEntry *retired;
+} EpochDomain;
+
+errno_t epoch_domain_init(EpochDomain *domain);
+/* There must be no readers left. Retired objects are destroyed. */
+void epoch_domain_terminate(EpochDomain *domain);
+
+EpochRecord *epoch_enter(EpochDomain *domain);
+void epoch_exit(EpochDomain *domain, EpochRecord *record);
+
+void epoch_retire(EpochDomain *domain, EpochEntry *entry,
+    void (*destroy_fun)(EpochEntry *entry));
+void epoch_reclaim(EpochDomain *domain);
+
+#endif
@@ -28,10 +28,37 @@ epollfd_close(FileDescription *desc)
 	return epollfd_ctx_terminate(&desc->ctx.epollfd);
 }
 
+static void
+epollfd_set_timer_slack(FileDescription *desc, long slack_nanos)
+{
+	atomic_store_explicit(&desc->ctx.epollfd.timer_slack_nanos, slack_nanos,
+	    memory_order_relaxed);
+}
+
+static void
+epollfd_poll(FileDescription *desc, int kq, uint32_t *revents)
+{
+	/*
+	 * A kqueue is only ever readable. Outer epoll instances ask for
+	 * 'revents' with their lock held, so don't lock in that case.
+	 * Without 'revents' no other epoll instance may be locked.
+	 */
+	if (revents != NULL) {
+		*revents = POLLIN;
+		return;
+	}
+
+	(void)pthread_mutex_lock(&desc->mutex);
+	epollfd_ctx_poll(&desc->ctx.epollfd, kq);
+	(void)pthread_mutex_unlock(&desc->mutex);
+}
+
 static struct file_description_vtable const epollfd_vtable = {
 	.read_fun = fd_context_default_read,
 	.write_fun = fd_context_default_write,
 	.close_fun = epollfd_close,
+	.poll_fun = epollfd_poll,
+	.set_timer_slack_fun = epollfd_set_timer_slack,
 };
 
 void
@@ -58,6 +85,86 @@ epollfd_remove_fd(FileDescription *desc, int kq, int fd)
 	}
 }
 
+/*
+ * Adding epoll fds to other epoll instances is serialized, so that two
+ * concurrent calls cannot create a cycle together. Like on Linux, adding
+ * an instance that would close a cycle or nest too deeply fails with
+ * ELOOP.
+ */
+static pthread_mutex_t epoll_nesting_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define EPOLL_MAX_NESTS 4
+
+typedef struct {
+	FileDescription **descs;
+	size_t descs_length;
+	size_t descs_size;
+	errno_t ec;
+} NestedDescs;
+
+static void
+epollfd_collect_nested_desc(PollableDesc pollable_desc, void *arg)
+{
+	NestedDescs *nested = arg;
+	FileDescription *desc = pollable_desc.ptr;
+
+	if (desc->vtable != &epollfd_vtable || nested->ec != 0) {
+		return;
+	}
+
+	if (nested->descs_length == nested->descs_size) {
+		size_t new_size = nested->descs_size ? 2 * nested->descs_size : 8;
+
+		FileDescription **new_descs = realloc(nested->descs,
+		    new_size * sizeof(FileDescription *));
+		if (!new_descs) {
+			nested->ec = ENOMEM;
+			return;
+		}
+
+		nested->descs = new_descs;
+		nested->descs_size = new_size;
+	}
+
+	pollable_desc_ref(pollable_desc);
+	nested->descs[nested->descs_length++] = desc;
+}
+
+static errno_t
+epollfd_check_nesting(FileDescription *desc, FileDescription *target,
+    int depth)
+{
+	if (desc == target || depth > EPOLL_MAX_NESTS) {
+		return ELOOP;
+	}
+
+	NestedDescs nested = { 0 };
+
+	(void)pthread_mutex_lock(&desc->mutex);
+	epollfd_ctx_for_each_nested_desc(&desc->ctx.epollfd,
+	    epollfd_collect_nested_desc, &nested);
+	(void)pthread_mutex_unlock(&desc->mutex);
+
+	errno_t ec = nested.ec;
+	for (size_t i = 0; i < nested.descs_length; ++i) {
+		if (ec == 0) {
+			ec = epollfd_check_nesting(nested.descs[i], target,
+			    depth + 1);
+		}
+		(void)file_description_unref(&nested.descs[i]);
+	}
+	free(nested.descs);
+
+	return ec;
+}
+
+static bool
+epollfd_is_nested_add(FileDescription *desc, FileDescription *fd2_desc)
+{
+	return fd2_desc && fd2_desc != desc &&
+	    fd2_desc->vtable == &epollfd_vtable;
+}
+
 static errno_t
 epoll_create_impl(int *fd_out, int flags)
 {
@@ -78,7 +185,12 @@ epoll_create_impl(int *fd_out, int flags)
 
 	desc->flags = flags & O_NONBLOCK;
 
-	if ((ec = epollfd_ctx_init(&desc->ctx.epollfd)) != 0) {
+	int ctx_flags = 0;
+	if (flags & EPOLL_SHIM_DEFER_CTL) {
+		ctx_flags |= EPOLLFD_CTX_FLAG_DEFER_CTL;
+	}
+
+	if ((ec = epollfd_ctx_init(&desc->ctx.epollfd, ctx_flags)) != 0) {
 		goto fail;
 	}
 
@@ -121,12 +233,14 @@ EPOLL_SHIM_EXPORT
 int
 epoll_create1(int flags)
 {
-	if (flags & ~EPOLL_CLOEXEC) {
+	if (flags & ~(EPOLL_CLOEXEC | EPOLL_SHIM_DEFER_CTL)) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	_Static_assert(EPOLL_CLOEXEC == O_CLOEXEC, "");
+	_Static_assert((EPOLL_SHIM_DEFER_CTL & (O_CLOEXEC | O_NONBLOCK)) == 0,
+	    "");
 
 	return epoll_create_common(flags);
 }
@@ -152,15 +266,38 @@ epoll_ctl_impl(int fd, int op, int fd2, struct epoll_event *ev)
 		goto out;
 	}
 
+	if (op == EPOLL_CTL_ADD &&
+	    (ec = epoll_shim_ctx_add_watcher(epoll_shim_ctx, fd, fd2)) != 0) {
+		goto out;
+	}
+
 	FileDescription *fd2_desc = (op == EPOLL_CTL_ADD) ?
 	    epoll_shim_ctx_find_desc(epoll_shim_ctx, fd2) :
 	    NULL;
 
+	bool const is_nested_add = epollfd_is_nested_add(desc, fd2_desc);
+	if (is_nested_add) {
+		(void)pthread_mutex_lock(&epoll_nesting_mutex);
+		if ((ec = epollfd_check_nesting(fd2_desc, desc, 1)) != 0) {
+			goto out_unlock_nesting;
+		}
+	}
+
+	/*
+	 * Bring 'fd2' up to date before taking our lock. For epoll fds
+	 * this applies their deferred changes, which locks them.
+	 */
+	pollable_desc_poll(fd_as_pollable_desc(fd2_desc), fd2, NULL);
+
 	(void)pthread_mutex_lock(&desc->mutex);
 	ec = epollfd_ctx_ctl(&desc->ctx.epollfd, fd, op, fd2,
 	    fd_as_pollable_desc(fd2_desc), ev);
 	(void)pthread_mutex_unlock(&desc->mutex);
 
+out_unlock_nesting:
+	if (is_nested_add) {
+		(void)pthread_mutex_unlock(&epoll_nesting_mutex);
+	}
 	if (fd2_desc) {
 		(void)file_description_unref(&fd2_desc);
 	}
@@ -183,6 +320,116 @@ epoll_ctl(int fd, int op, int fd2, struct epoll_event *ev)
 	ERRNO_RETURN(ec, -1, 0);
 }
 
+static errno_t
+epoll_ctl_batch_impl(int fd, struct epoll_shim_ctl_op *ops, int n,
+    int *nr_failed)
+{
+	errno_t ec;
+
+	if (n < 0) {
+		return EINVAL;
+	}
+
+	if (!ops && n != 0) {
+		return EFAULT;
+	}
+
+	EpollShimCtx *epoll_shim_ctx;
+	if ((ec = epoll_shim_ctx_global(&epoll_shim_ctx)) != 0) {
+		return ec;
+	}
+
+	FileDescription **fd2_descs = NULL;
+	PollableDesc *pollable_descs = NULL;
+
+	FileDescription *desc = epoll_shim_ctx_find_desc(epoll_shim_ctx, fd);
+	if (!desc || desc->vtable != &epollfd_vtable) {
+		struct stat sb;
+		ec = (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+		goto out;
+	}
+
+	if (n == 0) {
+		*nr_failed = 0;
+		ec = 0;
+		goto out;
+	}
+
+	fd2_descs = calloc((size_t)n, sizeof(FileDescription *));
+	pollable_descs = calloc((size_t)n, sizeof(PollableDesc));
+	if (!fd2_descs || !pollable_descs) {
+		ec = ENOMEM;
+		goto out;
+	}
+
+	bool has_nested_add = false;
+	for (int i = 0; i < n; ++i) {
+		if (ops[i].op == EPOLL_CTL_ADD) {
+			if ((ec = epoll_shim_ctx_add_watcher(epoll_shim_ctx, fd,
+				 ops[i].fd)) != 0) {
+				goto out_unref;
+			}
+			fd2_descs[i] = epoll_shim_ctx_find_desc(epoll_shim_ctx,
+			    ops[i].fd);
+			pollable_descs[i] = fd_as_pollable_desc(fd2_descs[i]);
+			has_nested_add |= epollfd_is_nested_add(desc,
+			    fd2_descs[i]);
+		}
+	}
+
+	if (has_nested_add) {
+		(void)pthread_mutex_lock(&epoll_nesting_mutex);
+		for (int i = 0; i < n; ++i) {
+			if (epollfd_is_nested_add(desc, fd2_descs[i]) &&
+			    (ec = epollfd_check_nesting(fd2_descs[i], desc,
+				 1)) != 0) {
+				goto out_unlock_nesting;
+			}
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		pollable_desc_poll(pollable_descs[i], ops[i].fd, NULL);
+	}
+
+	(void)pthread_mutex_lock(&desc->mutex);
+	ec = epollfd_ctx_ctl_batch(&desc->ctx.epollfd, fd, ops, pollable_descs,
+	    n, nr_failed);
+	(void)pthread_mutex_unlock(&desc->mutex);
+
+out_unlock_nesting:
+	if (has_nested_add) {
+		(void)pthread_mutex_unlock(&epoll_nesting_mutex);
+	}
+out_unref:
+	for (int i = 0; i < n; ++i) {
+		if (fd2_descs[i]) {
+			(void)file_description_unref(&fd2_descs[i]);
+		}
+	}
+
+out:
+	free(fd2_descs);
+	free(pollable_descs);
+	if (desc) {
+		(void)file_description_unref(&desc);
+	}
+	return ec;
+}
+
+EPOLL_SHIM_EXPORT
+int
+epoll_shim_ctl_batch(int fd, struct epoll_shim_ctl_op *ops, int n)
+{
+	ERRNO_SAVE;
+	errno_t ec;
+
+	int nr_failed;
+	ec = epoll_ctl_batch_impl(fd, ops, n, &nr_failed);
+
+	ERRNO_RETURN(ec, -1, nr_failed);
+}
+
 static errno_t
 epollfd_ctx_wait_or_block(FileDescription *desc, int kq, /**/
     struct epoll_event *ev, int cnt, int *actual_cnt,
@@ -194,20 +441,73 @@ epollfd_ctx_wait_or_block(FileDescription *desc, int kq, /**/
 	EpollFDCtx *epollfd = &desc->ctx.epollfd;
 
 	for (;;) {
+		bool const is_nonblocking = timeout &&
+		    timeout->tv_sec == 0 && timeout->tv_nsec == 0;
+
 		(void)pthread_mutex_lock(&desc->mutex);
-		ec = epollfd_ctx_wait(epollfd, kq, ev, cnt, actual_cnt);
-		(void)pthread_mutex_unlock(&desc->mutex);
-		if (ec != 0) {
-			return ec;
-		}
 
-		if (*actual_cnt ||
-		    (timeout && timeout->tv_sec == 0 &&
-			timeout->tv_nsec == 0)) {
-			return 0;
+		/*
+		 * Without poll-only fds and signal mask we can block in
+		 * kevent() directly and harvest events in the same call.
+		 * The lock is only held for the bookkeeping before and after,
+		 * so multiple threads can wait concurrently.
+		 */
+		if (epollfd->poll_fds_size == 0 && !sigs) {
+			KeventWait wait;
+			ec = epollfd_ctx_begin_kevent_wait(epollfd, cnt, &wait);
+			if (ec != 0) {
+				(void)pthread_mutex_unlock(&desc->mutex);
+				return ec;
+			}
+
+			(void)pthread_mutex_lock(
+			    &epollfd->nr_polling_threads_mutex);
+			++epollfd->nr_polling_threads;
+			(void)pthread_mutex_unlock(
+			    &epollfd->nr_polling_threads_mutex);
+
+			if (!is_nonblocking) {
+				epollfd_ctx_claim_exclusive_nodes(epollfd, kq);
+			}
+
+			(void)pthread_mutex_unlock(&desc->mutex);
+
+			int n = kevent(kq, wait.kevs, wait.nchanges, /**/
+			    wait.kevs, wait.length, timeout);
+			if (n < 0) {
+				ec = errno;
+			}
+
+			(void)pthread_mutex_lock(
+			    &epollfd->nr_polling_threads_mutex);
+			--epollfd->nr_polling_threads;
+			(void)pthread_cond_signal(
+			    &epollfd->nr_polling_threads_cond);
+			(void)pthread_mutex_unlock(
+			    &epollfd->nr_polling_threads_mutex);
+
+			(void)pthread_mutex_lock(&desc->mutex);
+			epollfd_ctx_end_kevent_wait(epollfd, kq, &wait,
+			    n < 0 ? 0 : n, ev, actual_cnt);
+			epollfd_ctx_release_exclusive_nodes(epollfd, kq);
+			(void)pthread_mutex_unlock(&desc->mutex);
+
+			if (n < 0) {
+				return ec;
+			}
+
+			if (*actual_cnt || is_nonblocking) {
+				return 0;
+			}
+
+			goto update_timeout;
 		}
 
-		(void)pthread_mutex_lock(&desc->mutex);
+		ec = epollfd_ctx_wait(epollfd, kq, ev, cnt, actual_cnt);
+		if (ec != 0 || *actual_cnt || is_nonblocking) {
+			(void)pthread_mutex_unlock(&desc->mutex);
+			return ec;
+		}
 
 		nfds_t nfds = (nfds_t)(1 + epollfd->poll_fds_size);
 
@@ -232,6 +532,8 @@ epollfd_ctx_wait_or_block(FileDescription *desc, int kq, /**/
 		++epollfd->nr_polling_threads;
 		(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
 
+		epollfd_ctx_claim_exclusive_nodes(epollfd, kq);
+
 		(void)pthread_mutex_unlock(&desc->mutex);
 
 		/*
@@ -252,16 +554,18 @@ epollfd_ctx_wait_or_block(FileDescription *desc, int kq, /**/
 
 		(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
 		--epollfd->nr_polling_threads;
-		if (epollfd->nr_polling_threads == 0) {
-			(void)pthread_cond_signal(
-			    &epollfd->nr_polling_threads_cond);
-		}
+		(void)pthread_cond_signal(&epollfd->nr_polling_threads_cond);
 		(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
 
+		(void)pthread_mutex_lock(&desc->mutex);
+		epollfd_ctx_release_exclusive_nodes(epollfd, kq);
+		(void)pthread_mutex_unlock(&desc->mutex);
+
 		if (n < 0) {
 			return ec;
 		}
 
+	update_timeout:
 		if (timeout) {
 			struct timespec current_time;
 
@@ -302,6 +606,24 @@ timeout_to_deadline(struct timespec *deadline, struct timespec *timeout, int to)
 	return 0;
 }
 
+/*
+ * Delays the deadline to the next multiple of the slack, so that threads
+ * waiting with nearby deadlines wake up together.
+ */
+static void
+apply_timer_slack(struct timespec *deadline, struct timespec *timeout,
+    long slack_nanos)
+{
+	struct timespec coalesced;
+	struct timespec delay;
+
+	if (timespec_round_up(deadline, slack_nanos, &coalesced) &&
+	    timespecsub_safe(&coalesced, deadline, &delay) &&
+	    timespecadd_safe(timeout, &delay, timeout)) {
+		*deadline = coalesced;
+	}
+}
+
 static errno_t
 epoll_pwait_impl(int fd, struct epoll_event *ev, int cnt, int to,
     sigset_t const *sigs, int *actual_cnt)
@@ -331,6 +653,14 @@ epoll_pwait_impl(int fd, struct epoll_event *ev, int cnt, int to,
 		goto out;
 	}
 
+	if (to > 0) {
+		long slack_nanos = atomic_load_explicit(
+		    &desc->ctx.epollfd.timer_slack_nanos, memory_order_relaxed);
+		if (slack_nanos != 0) {
+			apply_timer_slack(&deadline, &timeout, slack_nanos);
+		}
+	}
+
 	ec = epollfd_ctx_wait_or_block(desc, fd, ev, cnt, actual_cnt, /**/
 	    (to >= 0) ? &deadline : NULL,			      /**/
 	    (to >= 0) ? &timeout : NULL,			      /**/
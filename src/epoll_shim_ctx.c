@@ -5,11 +5,13 @@
 /* For FIONBIO. */
 #include <sys/filio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,6 +69,28 @@ file_description_ref(FileDescription *desc)
 	atomic_fetch_add_explicit(&desc->refcount, 1, memory_order_relaxed);
 }
 
+/*
+ * Lookups race with the last reference being dropped. The memory stays
+ * valid until the lookup's epoch is over, but the descriptor may already
+ * be terminated.
+ */
+static bool
+file_description_try_ref(FileDescription *desc)
+{
+	int refcount = atomic_load_explicit(&desc->refcount,
+	    memory_order_relaxed);
+
+	do {
+		if (refcount == 0) {
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&desc->refcount,
+	    &refcount, refcount + 1, memory_order_acquire,
+	    memory_order_relaxed));
+
+	return true;
+}
+
 static errno_t
 file_description_terminate(FileDescription *desc)
 {
@@ -87,11 +111,13 @@ file_description_terminate(FileDescription *desc)
 	return ec;
 }
 
+static void epoll_shim_ctx_retire_desc(FileDescription *desc);
+
 static errno_t
 file_description_destroy(FileDescription **desc)
 {
 	errno_t ec = file_description_terminate(*desc);
-	free(*desc);
+	epoll_shim_ctx_retire_desc(*desc);
 	return ec;
 }
 
@@ -176,10 +202,80 @@ fd_context_default_write(FileDescription *desc, int kq, /**/
 
 /**/
 
+typedef struct {
+	int *efds;
+	unsigned int nr_efds;
+	unsigned int efds_size;
+} FDWatchers;
+
+/*
+ * Two bits of state per fd, readable without a lock. An fd is "known"
+ * if it is a shim descriptor or has been added to an epoll instance.
+ * Only closes of known fds need to take any locks. "Closing" is set while
+ * an fd is being closed.
+ */
+#define FD_STATE_KNOWN 1U
+#define FD_STATE_CLOSING 2U
+#define FD_STATE_BITS 2
+#define FD_STATES_PER_WORD 32
+#define FD_STATE_CHUNK_FDS 65536
+#define FD_STATE_NR_CHUNKS (INT_MAX / FD_STATE_CHUNK_FDS + 1)
+
+typedef struct {
+	atomic_uint_least64_t words[FD_STATE_CHUNK_FDS / FD_STATES_PER_WORD];
+} FDStateChunk;
+
+/*
+ * The fd table is a three level radix tree. Leaves and inner nodes are
+ * allocated when the first fd in their range is installed and are never
+ * freed, so it never has to be copied.
+ */
+#define FD_TABLE_LEAF_BITS 10
+#define FD_TABLE_NODE_BITS 10
+#define FD_TABLE_ROOT_SIZE \
+	((INT_MAX >> (FD_TABLE_LEAF_BITS + FD_TABLE_NODE_BITS)) + 1)
+
+typedef struct {
+	FileDescription *_Atomic descs[1 << FD_TABLE_LEAF_BITS];
+} FDTableLeaf;
+
+typedef struct {
+	FDTableLeaf *_Atomic leaves[1 << FD_TABLE_NODE_BITS];
+} FDTableNode;
+
+/* The watcher index has the same shape, but is only used under a lock. */
+typedef struct {
+	FDWatchers watchers[1 << FD_TABLE_LEAF_BITS];
+} FDWatchersLeaf;
+
+typedef struct {
+	FDWatchersLeaf *leaves[1 << FD_TABLE_NODE_BITS];
+} FDWatchersNode;
+
+/*
+ * 'open_files' is changed with 'rwlock' held for writing. Lookups only
+ * enter 'epoch': descriptors whose last reference is gone are freed once
+ * all lookups that might see them are done.
+ */
 struct epoll_shim_ctx {
-	FileDescription **open_files;
-	unsigned int open_files_length;
+	FDTableNode *_Atomic open_files[FD_TABLE_ROOT_SIZE];
 	RWLock rwlock;
+	EpochDomain epoch;
+
+	/*
+	 * Reverse index from fds to the epoll fds they have been added to.
+	 * Entries are only removed when the fd is closed, so the index may
+	 * name epoll fds that no longer watch the fd (or are not epoll fds
+	 * anymore). Adding an fd that is being closed to an epoll instance
+	 * has to wait on 'watchers_cond'.
+	 */
+	pthread_mutex_t watchers_mutex;
+	pthread_cond_t watchers_cond;
+	atomic_uint nr_watchers_cond_waiters;
+	FDWatchersNode *watchers[FD_TABLE_ROOT_SIZE];
+
+	/* Allocated on demand, never freed. */
+	FDStateChunk *_Atomic fd_state_chunks[FD_STATE_NR_CHUNKS];
 
 	/* members for realtime timer change detection */
 	pthread_mutex_t step_detector_mutex;
@@ -192,7 +288,10 @@ epoll_shim_ctx_init(EpollShimCtx *epoll_shim_ctx)
 {
 	errno_t ec;
 
-	*epoll_shim_ctx = (EpollShimCtx) {};
+	/*
+	 * The context lives in static storage and starts out zeroed. Don't
+	 * clear it again, that would touch all pages of the fd tables.
+	 */
 
 	if ((ec = pthread_mutex_init(/**/
 		 &epoll_shim_ctx->step_detector_mutex, NULL)) != 0) {
@@ -203,8 +302,27 @@ epoll_shim_ctx_init(EpollShimCtx *epoll_shim_ctx)
 		goto out_rwlock;
 	}
 
+	if ((ec = epoch_domain_init(&epoll_shim_ctx->epoch)) != 0) {
+		goto out_epoch;
+	}
+
+	if ((ec = pthread_mutex_init(/**/
+		 &epoll_shim_ctx->watchers_mutex, NULL)) != 0) {
+		goto out_watchers_mutex;
+	}
+
+	if ((ec = pthread_cond_init(/**/
+		 &epoll_shim_ctx->watchers_cond, NULL)) != 0) {
+		goto out_watchers_cond;
+	}
+
 	return 0;
 
+out_watchers_cond:
+	(void)pthread_mutex_destroy(&epoll_shim_ctx->watchers_mutex);
+out_watchers_mutex:
+	epoch_domain_terminate(&epoll_shim_ctx->epoch);
+out_epoch:
 	(void)rwlock_terminate(&epoll_shim_ctx->rwlock);
 out_rwlock:
 	(void)pthread_mutex_destroy(&epoll_shim_ctx->step_detector_mutex);
@@ -232,60 +350,165 @@ epoll_shim_ctx_global(EpollShimCtx **epoll_shim_ctx_out)
 	return 0;
 }
 
+static void
+file_description_free(EpochEntry *entry)
+{
+	free((char *)entry - offsetof(FileDescription, epoch_entry));
+}
+
+static void
+epoll_shim_ctx_retire_desc(FileDescription *desc)
+{
+	epoch_retire(&epoll_shim_ctx_global_.epoch, &desc->epoch_entry,
+	    file_description_free);
+}
+
 /**/
 
-errno_t
-epoll_shim_ctx_create_desc(EpollShimCtx *epoll_shim_ctx, int flags, /**/
-    int *fd, FileDescription **desc)
+static atomic_uint_least64_t *
+epoll_shim_ctx_fd_state_word(EpollShimCtx *epoll_shim_ctx, int fd)
 {
-	errno_t ec = 0;
+	assert(fd >= 0);
 
-	rwlock_lock_write(&epoll_shim_ctx->rwlock);
+	FDStateChunk *_Atomic *chunk_ptr =
+	    &epoll_shim_ctx->fd_state_chunks[fd / FD_STATE_CHUNK_FDS];
 
-	int kq = kqueue1(flags);
-	if (kq < 0) {
-		ec = errno;
-		goto out_kqueue;
+	FDStateChunk *chunk = atomic_load(chunk_ptr);
+	if (!chunk) {
+		FDStateChunk *new_chunk = malloc(sizeof(FDStateChunk));
+		if (!new_chunk) {
+			return NULL;
+		}
+		for (size_t i = 0;
+		     i < FD_STATE_CHUNK_FDS / FD_STATES_PER_WORD; ++i) {
+			atomic_init(&new_chunk->words[i], 0);
+		}
+
+		if (atomic_compare_exchange_strong(chunk_ptr, &chunk,
+			new_chunk)) {
+			chunk = new_chunk;
+		} else {
+			free(new_chunk);
+		}
+	}
+
+	return &chunk->words[(fd % FD_STATE_CHUNK_FDS) / FD_STATES_PER_WORD];
+}
+
+static unsigned int
+epoll_shim_ctx_fd_state_shift(int fd)
+{
+	return (unsigned int)(fd % FD_STATES_PER_WORD) * FD_STATE_BITS;
+}
+
+static _Atomic(FileDescription *) *
+epoll_shim_ctx_find_slot(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	if (fd < 0) {
+		return NULL;
 	}
 
-	unsigned int open_files_length = epoll_shim_ctx->open_files_length;
+	unsigned int ufd = (unsigned int)fd;
 
-	while (open_files_length <= (unsigned int)kq) {
-		unsigned int space_needed = 32;
-		while (space_needed <= (unsigned int)kq) {
-			space_needed <<= 1;
+	FDTableNode *node = atomic_load_explicit(
+	    &epoll_shim_ctx
+		 ->open_files[ufd >> (FD_TABLE_LEAF_BITS + FD_TABLE_NODE_BITS)],
+	    memory_order_acquire);
+	if (!node) {
+		return NULL;
+	}
+
+	FDTableLeaf *leaf = atomic_load_explicit(
+	    &node->leaves[(ufd >> FD_TABLE_LEAF_BITS) &
+		((1U << FD_TABLE_NODE_BITS) - 1)],
+	    memory_order_acquire);
+	if (!leaf) {
+		return NULL;
+	}
+
+	return &leaf->descs[ufd & ((1U << FD_TABLE_LEAF_BITS) - 1)];
+}
+
+/*
+ * Creates the table levels leading to the slot of 'fd'. This doesn't need
+ * 'rwlock', concurrent callers race to install new levels.
+ */
+static errno_t
+epoll_shim_ctx_create_slot(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	assert(fd >= 0);
+
+	unsigned int ufd = (unsigned int)fd;
+
+	FDTableNode *_Atomic *node_ptr = &epoll_shim_ctx->open_files[ufd >>
+	    (FD_TABLE_LEAF_BITS + FD_TABLE_NODE_BITS)];
+	FDTableNode *node = atomic_load_explicit(node_ptr,
+	    memory_order_acquire);
+	if (!node) {
+		FDTableNode *new_node = malloc(sizeof(FDTableNode));
+		if (!new_node) {
+			return errno;
+		}
+		for (size_t i = 0; i < (1U << FD_TABLE_NODE_BITS); ++i) {
+			atomic_init(&new_node->leaves[i], NULL);
 		}
 
-		size_t size;
-		if (__builtin_mul_overflow(space_needed,
-			sizeof(FileDescription *), &size)) {
-			ec = ENOMEM;
-			goto out;
+		if (atomic_compare_exchange_strong_explicit(node_ptr, &node,
+			new_node, memory_order_acq_rel,
+			memory_order_acquire)) {
+			node = new_node;
+		} else {
+			free(new_node);
 		}
+	}
 
-		FileDescription **new_files =
-		    realloc(epoll_shim_ctx->open_files, size);
-		if (!new_files) {
-			ec = errno;
-			goto out;
+	FDTableLeaf *_Atomic *leaf_ptr =
+	    &node->leaves[(ufd >> FD_TABLE_LEAF_BITS) &
+		((1U << FD_TABLE_NODE_BITS) - 1)];
+	FDTableLeaf *leaf = atomic_load_explicit(leaf_ptr,
+	    memory_order_acquire);
+	if (!leaf) {
+		FDTableLeaf *new_leaf = malloc(sizeof(FDTableLeaf));
+		if (!new_leaf) {
+			return errno;
+		}
+		for (size_t i = 0; i < (1U << FD_TABLE_LEAF_BITS); ++i) {
+			atomic_init(&new_leaf->descs[i], NULL);
 		}
 
-		size_t old_size = open_files_length * sizeof(FileDescription *);
-		memset(&new_files[open_files_length], 0, size - old_size);
+		if (!atomic_compare_exchange_strong_explicit(leaf_ptr, &leaf,
+			new_leaf, memory_order_acq_rel,
+			memory_order_acquire)) {
+			free(new_leaf);
+		}
+	}
+
+	return 0;
+}
+
+errno_t
+epoll_shim_ctx_create_desc(EpollShimCtx *epoll_shim_ctx, int flags, /**/
+    int *fd, FileDescription **desc)
+{
+	errno_t ec = 0;
+
+	/*
+	 * Until the descriptor is installed, nobody else knows about 'kq'.
+	 * Everything that can fail happens here, without 'rwlock'.
+	 */
+
+	int kq = kqueue1(flags);
+	if (kq < 0) {
+		return errno;
+	}
 
-		epoll_shim_ctx->open_files = new_files;
-		epoll_shim_ctx->open_files_length = space_needed;
-		break;
+	if ((ec = epoll_shim_ctx_create_slot(epoll_shim_ctx, kq)) != 0) {
+		goto out;
 	}
 
-	if (epoll_shim_ctx->open_files[kq] != NULL) {
-		/*
-		 * If we get here, someone must have already closed the old fd
-		 * with a normal 'close()' call, i.e. not with our
-		 * 'epoll_shim_close()' wrapper.
-		 */
-		(void)file_description_unref(&epoll_shim_ctx->open_files[kq]);
-		epoll_shim_ctx->open_files[kq] = NULL;
+	if (!epoll_shim_ctx_fd_state_word(epoll_shim_ctx, kq)) {
+		ec = ENOMEM;
+		goto out;
 	}
 
 	ec = file_description_create(desc);
@@ -298,8 +521,6 @@ epoll_shim_ctx_create_desc(EpollShimCtx *epoll_shim_ctx, int flags, /**/
 out:
 	if (ec != 0) {
 		real_close(kq);
-	out_kqueue:
-		rwlock_unlock_write(&epoll_shim_ctx->rwlock);
 	}
 
 	return ec;
@@ -309,18 +530,41 @@ void
 epoll_shim_ctx_install_desc(EpollShimCtx *epoll_shim_ctx, /**/
     int fd, FileDescription *desc)
 {
-	assert((unsigned int)fd < epoll_shim_ctx->open_files_length);
-	epoll_shim_ctx->open_files[fd] = desc;
+	_Atomic(FileDescription *) *slot =
+	    epoll_shim_ctx_find_slot(epoll_shim_ctx, fd);
+	atomic_uint_least64_t *state = /**/
+	    epoll_shim_ctx_fd_state_word(epoll_shim_ctx, fd);
+	assert(slot != NULL && state != NULL);
+
+	FileDescription *stale_desc;
+
+	rwlock_lock_write(&epoll_shim_ctx->rwlock);
+	stale_desc = atomic_exchange_explicit(slot, desc, memory_order_acq_rel);
+	atomic_fetch_or(state, /**/
+	    (uint_least64_t)FD_STATE_KNOWN
+		<< epoll_shim_ctx_fd_state_shift(fd));
 	rwlock_unlock_write(&epoll_shim_ctx->rwlock);
+
+	if (stale_desc != NULL) {
+		/*
+		 * If we get here, someone must have already closed the old fd
+		 * with a normal 'close()' call, i.e. not with our
+		 * 'epoll_shim_close()' wrapper.
+		 */
+		(void)file_description_unref(&stale_desc);
+	}
 }
 
+/*
+ * Without 'rwlock' held, the descriptor must be used from within an epoch
+ * and might already be terminated.
+ */
 static FileDescription *
 epoll_shim_ctx_find_desc_impl(EpollShimCtx *epoll_shim_ctx, int fd)
 {
-	if (fd < 0 || (unsigned int)fd >= epoll_shim_ctx->open_files_length) {
-		return NULL;
-	}
-	return epoll_shim_ctx->open_files[fd];
+	_Atomic(FileDescription *) *slot =
+	    epoll_shim_ctx_find_slot(epoll_shim_ctx, fd);
+	return slot ? atomic_load_explicit(slot, memory_order_acquire) : NULL;
 }
 
 FileDescription *
@@ -332,55 +576,201 @@ epoll_shim_ctx_find_desc(EpollShimCtx *epoll_shim_ctx, int fd)
 
 	FileDescription *desc;
 
-	rwlock_lock_read(&epoll_shim_ctx->rwlock);
+	EpochRecord *record = epoch_enter(&epoll_shim_ctx->epoch);
 	desc = epoll_shim_ctx_find_desc_impl(epoll_shim_ctx, fd);
-	if (desc != NULL) {
-		file_description_ref(desc);
+	if (desc != NULL && !file_description_try_ref(desc)) {
+		desc = NULL;
 	}
-	rwlock_unlock_read(&epoll_shim_ctx->rwlock);
+	epoch_exit(&epoll_shim_ctx->epoch, record);
 
 	return desc;
 }
 
+#ifndef HAVE_TIMERFD
 static void
 epoll_shim_ctx_for_each_unlocked(EpollShimCtx *epoll_shim_ctx,
     void (*fun)(FileDescription *desc, int kq, void *arg), void *arg)
 {
-	for (unsigned int i = 0;
-	     i < epoll_shim_ctx->open_files_length && i <= INT_MAX; ++i) {
-		FileDescription *desc = epoll_shim_ctx->open_files[i];
-		if (!desc) {
+	for (unsigned int i = 0; i < FD_TABLE_ROOT_SIZE; ++i) {
+		FDTableNode *node = atomic_load_explicit(
+		    &epoll_shim_ctx->open_files[i], memory_order_relaxed);
+		if (!node) {
 			continue;
 		}
 
-		fun(desc, (int)i, arg);
+		for (unsigned int j = 0; j < (1U << FD_TABLE_NODE_BITS); ++j) {
+			FDTableLeaf *leaf = atomic_load_explicit(
+			    &node->leaves[j], memory_order_relaxed);
+			if (!leaf) {
+				continue;
+			}
+
+			for (unsigned int k = 0;
+			     k < (1U << FD_TABLE_LEAF_BITS); ++k) {
+				FileDescription *desc = atomic_load_explicit(
+				    &leaf->descs[k], memory_order_relaxed);
+				if (!desc) {
+					continue;
+				}
+
+				fun(desc,
+				    (int)((((i << FD_TABLE_NODE_BITS) | j)
+					      << FD_TABLE_LEAF_BITS) |
+					k),
+				    arg);
+			}
+		}
 	}
 }
+#endif
 
 void epollfd_lock(FileDescription *desc);
 void epollfd_unlock(FileDescription *desc);
 void epollfd_remove_fd(FileDescription *desc, int kq, int fd);
-static void
-remove_desc_lock_epollfd(FileDescription *desc, int kq, void *arg)
+
+/*
+ * Must be called with 'watchers_mutex' held. Missing levels are only
+ * allocated if 'create' is set.
+ */
+static FDWatchers *
+epoll_shim_ctx_find_watchers(EpollShimCtx *epoll_shim_ctx, int fd,
+    bool create)
 {
-	(void)kq;
-	(void)arg;
+	assert(fd >= 0);
 
-	epollfd_lock(desc);
+	unsigned int ufd = (unsigned int)fd;
+
+	FDWatchersNode **node_ptr = &epoll_shim_ctx->watchers[ufd >>
+	    (FD_TABLE_LEAF_BITS + FD_TABLE_NODE_BITS)];
+	if (!*node_ptr &&
+	    (!create || !(*node_ptr = calloc(1, sizeof(FDWatchersNode))))) {
+		return NULL;
+	}
+
+	FDWatchersLeaf **leaf_ptr =
+	    &(*node_ptr)->leaves[(ufd >> FD_TABLE_LEAF_BITS) &
+		((1U << FD_TABLE_NODE_BITS) - 1)];
+	if (!*leaf_ptr &&
+	    (!create || !(*leaf_ptr = calloc(1, sizeof(FDWatchersLeaf))))) {
+		return NULL;
+	}
+
+	return &(*leaf_ptr)->watchers[ufd & ((1U << FD_TABLE_LEAF_BITS) - 1)];
 }
+
+errno_t
+epoll_shim_ctx_add_watcher(EpollShimCtx *epoll_shim_ctx, int efd, int fd2)
+{
+	errno_t ec = 0;
+
+	if (efd < 0 || fd2 < 0 || efd == fd2) {
+		return 0;
+	}
+
+	atomic_uint_least64_t *state = /**/
+	    epoll_shim_ctx_fd_state_word(epoll_shim_ctx, fd2);
+	if (!state) {
+		return ENOMEM;
+	}
+	unsigned int shift = epoll_shim_ctx_fd_state_shift(fd2);
+
+	(void)pthread_mutex_lock(&epoll_shim_ctx->watchers_mutex);
+
+	/*
+	 * Marking 'fd2' as known makes sure that a concurrent close of it
+	 * takes the slow path. If it is being closed right now, the epoll
+	 * instance would not be locked by the closing thread. Wait until the
+	 * close is done; 'fd2' is then either invalid or a new file.
+	 */
+	while ((atomic_fetch_or(state,
+		    (uint_least64_t)FD_STATE_KNOWN << shift) >>
+		   shift) &
+	    FD_STATE_CLOSING) {
+		atomic_fetch_add(&epoll_shim_ctx->nr_watchers_cond_waiters, 1);
+		while ((atomic_load(state) >> shift) & FD_STATE_CLOSING) {
+			(void)pthread_cond_wait(&epoll_shim_ctx->watchers_cond,
+			    &epoll_shim_ctx->watchers_mutex);
+		}
+		atomic_fetch_sub(&epoll_shim_ctx->nr_watchers_cond_waiters, 1);
+	}
+
+	FDWatchers *watchers = epoll_shim_ctx_find_watchers(epoll_shim_ctx,
+	    fd2, true);
+	if (!watchers) {
+		ec = ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < watchers->nr_efds; ++i) {
+		if (watchers->efds[i] == efd) {
+			goto out;
+		}
+	}
+
+	if (watchers->nr_efds == watchers->efds_size) {
+		unsigned int new_size = watchers->efds_size == 0 ?
+		    2 :
+		    watchers->efds_size * 2;
+
+		int *new_efds = realloc(watchers->efds,
+		    new_size * sizeof(int));
+		if (!new_efds) {
+			ec = errno;
+			goto out;
+		}
+
+		watchers->efds = new_efds;
+		watchers->efds_size = new_size;
+	}
+
+	watchers->efds[watchers->nr_efds++] = efd;
+
+out:
+	(void)pthread_mutex_unlock(&epoll_shim_ctx->watchers_mutex);
+	return ec;
+}
+
+static int
+compare_fds(void const *a, void const *b)
+{
+	int x = *(int const *)a;
+	int y = *(int const *)b;
+	return (x > y) - (x < y);
+}
+
 static void
-remove_desc_remove_fd_from_epollfd(FileDescription *desc, int kq, void *arg)
+epoll_shim_ctx_take_watchers(EpollShimCtx *epoll_shim_ctx, int fd,
+    FDWatchers *watchers_out)
 {
-	epollfd_remove_fd(desc, kq, *(int *)arg);
+	*watchers_out = (FDWatchers) {};
+
+	(void)pthread_mutex_lock(&epoll_shim_ctx->watchers_mutex);
+	FDWatchers *watchers = epoll_shim_ctx_find_watchers(epoll_shim_ctx,
+	    fd, false);
+	if (watchers) {
+		*watchers_out = *watchers;
+		*watchers = (FDWatchers) {};
+	}
+	(void)pthread_mutex_unlock(&epoll_shim_ctx->watchers_mutex);
+
+	/* Lock the epoll instances in a consistent order. */
+	qsort(watchers_out->efds, watchers_out->nr_efds, sizeof(int),
+	    compare_fds);
 }
+
 static void
-remove_desc_unlock_epollfd(FileDescription *desc, int kq, void *arg)
+epoll_shim_ctx_finish_closing(EpollShimCtx *epoll_shim_ctx,
+    atomic_uint_least64_t *state, unsigned int shift)
 {
-	(void)kq;
-	(void)arg;
+	atomic_fetch_and(state, ~((uint_least64_t)FD_STATE_CLOSING << shift));
 
-	epollfd_unlock(desc);
+	if (atomic_load(&epoll_shim_ctx->nr_watchers_cond_waiters) != 0) {
+		(void)pthread_mutex_lock(&epoll_shim_ctx->watchers_mutex);
+		(void)pthread_cond_broadcast(&epoll_shim_ctx->watchers_cond);
+		(void)pthread_mutex_unlock(&epoll_shim_ctx->watchers_mutex);
+	}
 }
+
 static errno_t
 epoll_shim_ctx_remove_desc(EpollShimCtx *epoll_shim_ctx, int fd)
 {
@@ -389,32 +779,105 @@ epoll_shim_ctx_remove_desc(EpollShimCtx *epoll_shim_ctx, int fd)
 
 	assert(fd >= 0);
 
+	/*
+	 * If allocating the state word fails, 'fd' cannot have been added to
+	 * an epoll instance or be a shim descriptor, but a concurrent
+	 * 'epoll_ctl()' is not excluded while it is closed.
+	 */
+	atomic_uint_least64_t *state = /**/
+	    epoll_shim_ctx_fd_state_word(epoll_shim_ctx, fd);
+	unsigned int shift = epoll_shim_ctx_fd_state_shift(fd);
+
+	if (state) {
+		uint_least64_t old_state = atomic_fetch_or(state,
+		    (uint_least64_t)FD_STATE_CLOSING << shift);
+
+		/*
+		 * Another thread is closing the same fd. That is a race in
+		 * the application, so just pass the close on to the kernel
+		 * and leave the bookkeeping and the bit to that thread.
+		 */
+		if ((old_state >> shift) & FD_STATE_CLOSING) {
+			return real_close(fd) < 0 ? errno : 0;
+		}
+
+		/*
+		 * Most fds closed by the application were never seen by us.
+		 * They don't need any locks.
+		 */
+		if (!((old_state >> shift) & FD_STATE_KNOWN)) {
+			ec = real_close(fd) < 0 ? errno : 0;
+			epoll_shim_ctx_finish_closing(epoll_shim_ctx, /**/
+			    state, shift);
+			return ec;
+		}
+	}
+
+	/*
+	 * Only the epoll instances 'fd' has been added to need to forget
+	 * about it.
+	 */
+	FDWatchers watchers;
+	epoll_shim_ctx_take_watchers(epoll_shim_ctx, fd, &watchers);
+
 	rwlock_lock_write(&epoll_shim_ctx->rwlock);
 	{
-		desc = epoll_shim_ctx_find_desc_impl(epoll_shim_ctx, fd);
+		_Atomic(FileDescription *) *slot =
+		    epoll_shim_ctx_find_slot(epoll_shim_ctx, fd);
+		desc = slot ? atomic_load_explicit(slot, memory_order_relaxed) :
+			      NULL;
 		if (desc) {
-			epoll_shim_ctx->open_files[fd] = NULL;
+			atomic_store_explicit(slot, NULL, memory_order_relaxed);
 		}
 	}
 	rwlock_downgrade(&epoll_shim_ctx->rwlock);
 	{
-		epoll_shim_ctx_for_each_unlocked(epoll_shim_ctx,
-		    remove_desc_lock_epollfd, NULL);
-		epoll_shim_ctx_for_each_unlocked(epoll_shim_ctx,
-		    remove_desc_remove_fd_from_epollfd, &fd);
+		for (unsigned int i = 0; i < watchers.nr_efds; ++i) {
+			FileDescription *epollfd_desc =
+			    epoll_shim_ctx_find_desc_impl(epoll_shim_ctx,
+				watchers.efds[i]);
+			if (epollfd_desc) {
+				epollfd_lock(epollfd_desc);
+			}
+		}
+		for (unsigned int i = 0; i < watchers.nr_efds; ++i) {
+			FileDescription *epollfd_desc =
+			    epoll_shim_ctx_find_desc_impl(epoll_shim_ctx,
+				watchers.efds[i]);
+			if (epollfd_desc) {
+				epollfd_remove_fd(epollfd_desc,
+				    watchers.efds[i], fd);
+			}
+		}
 		if (desc) {
 			errno_t ec_local = file_description_unref(&desc);
 			ec = ec != 0 ? ec : ec_local;
 		}
+		if (state) {
+			/* The fd number may be reused right after this. */
+			atomic_fetch_and(state,
+			    ~((uint_least64_t)FD_STATE_KNOWN << shift));
+		}
 		{
 			errno_t ec_local = real_close(fd) < 0 ? errno : 0;
 			ec = ec != 0 ? ec : ec_local;
 		}
-		epoll_shim_ctx_for_each_unlocked(epoll_shim_ctx,
-		    remove_desc_unlock_epollfd, NULL);
+		for (unsigned int i = 0; i < watchers.nr_efds; ++i) {
+			FileDescription *epollfd_desc =
+			    epoll_shim_ctx_find_desc_impl(epoll_shim_ctx,
+				watchers.efds[i]);
+			if (epollfd_desc) {
+				epollfd_unlock(epollfd_desc);
+			}
+		}
 	}
 	rwlock_unlock_read(&epoll_shim_ctx->rwlock);
 
+	if (state) {
+		epoll_shim_ctx_finish_closing(epoll_shim_ctx, state, shift);
+	}
+	free(watchers.efds);
+
 	return ec;
 }
 
@@ -422,9 +885,10 @@ void
 epoll_shim_ctx_drop_desc(EpollShimCtx *epoll_shim_ctx, /**/
     int fd, FileDescription *desc)
 {
+	(void)epoll_shim_ctx;
+
 	(void)file_description_unref(&desc);
 	(void)real_close(fd);
-	rwlock_unlock_write(&epoll_shim_ctx->rwlock);
 }
 
 #ifndef HAVE_TIMERFD
@@ -666,9 +1130,8 @@ epoll_shim_ppoll_deadline(EpollShimCtx *epoll_shim_ctx, /**/
 
 retry:;
 	if (fds != NULL) {
-		rwlock_lock_read(&epoll_shim_ctx->rwlock);
 		for (nfds_t i = 0; i < nfds; ++i) {
-			FileDescription *desc = epoll_shim_ctx_find_desc_impl(
+			FileDescription *desc = epoll_shim_ctx_find_desc(
 			    epoll_shim_ctx, fds[i].fd);
 			if (!desc) {
 				continue;
@@ -676,8 +1139,8 @@ retry:;
 			if (desc->vtable->poll_fun != NULL) {
 				desc->vtable->poll_fun(desc, fds[i].fd, NULL);
 			}
+			(void)file_description_unref(&desc);
 		}
-		rwlock_unlock_read(&epoll_shim_ctx->rwlock);
 	}
 
 	int n = real_ppoll(fds, nfds, timeout, sigmask);
@@ -689,14 +1152,13 @@ retry:;
 		return 0;
 	}
 
-	rwlock_lock_read(&epoll_shim_ctx->rwlock);
 	for (nfds_t i = 0; i < nfds; ++i) {
 		if (fds[i].revents == 0) {
 			continue;
 		}
 
 		FileDescription *desc =
-		    epoll_shim_ctx_find_desc_impl(epoll_shim_ctx, fds[i].fd);
+		    epoll_shim_ctx_find_desc(epoll_shim_ctx, fds[i].fd);
 		if (!desc) {
 			continue;
 		}
@@ -708,8 +1170,8 @@ retry:;
 				--n;
 			}
 		}
+		(void)file_description_unref(&desc);
 	}
-	rwlock_unlock_read(&epoll_shim_ctx->rwlock);
 
 	if (n == 0 &&
 	    !(timeout && timeout->tv_sec == 0 && timeout->tv_nsec == 0)) {
@@ -830,3 +1292,37 @@ epoll_shim_fcntl(int fd, int cmd, ...)
 	(void)file_description_unref(&desc);
 	ERRNO_RETURN(ec, -1, 0);
 }
+
+EPOLL_SHIM_EXPORT
+int
+epoll_shim_set_timer_slack(int fd, long slack_nanos)
+{
+	ERRNO_SAVE;
+	errno_t ec;
+
+	EpollShimCtx *epoll_shim_ctx;
+	if ((ec = epoll_shim_ctx_global(&epoll_shim_ctx)) != 0) {
+		ERRNO_RETURN(ec, -1, 0);
+	}
+
+	FileDescription *desc = epoll_shim_ctx_find_desc(epoll_shim_ctx, fd);
+	if (!desc || desc->vtable->set_timer_slack_fun == NULL) {
+		struct stat sb;
+		ec = (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+		goto out;
+	}
+
+	if (slack_nanos < 0) {
+		ec = EINVAL;
+		goto out;
+	}
+
+	desc->vtable->set_timer_slack_fun(desc, slack_nanos);
+	ec = 0;
+
+out:
+	if (desc) {
+		(void)file_description_unref(&desc);
+	}
+	ERRNO_RETURN(ec, -1, 0);
+}
@@ -13,6 +13,7 @@
 #include "signalfd_ctx.h"
 #include "timerfd_ctx.h"
 
+#include "epoch.h"
 #include "rwlock.h"
 
 struct file_description_vtable;
@@ -27,6 +28,7 @@ typedef struct {
 		SignalFDCtx signalfd;
 	} ctx;
 	struct file_description_vtable const *vtable;
+	EpochEntry epoch_entry;
 } FileDescription;
 
 errno_t file_description_unref(FileDescription **desc);
@@ -39,6 +41,8 @@ typedef errno_t (*fd_context_close_fun)(FileDescription *desc);
 typedef void (*fd_context_poll_fun)(FileDescription *desc, int kq, /**/
     uint32_t *revents);
 typedef void (*fd_context_realtime_change_fun)(FileDescription *desc, int kq);
+typedef void (*fd_context_set_timer_slack_fun)(FileDescription *desc,
+    long slack_nanos);
 
 struct file_description_vtable {
 	fd_context_read_fun read_fun;
@@ -46,6 +50,7 @@ struct file_description_vtable {
 	fd_context_close_fun close_fun;
 	fd_context_poll_fun poll_fun;
 	fd_context_realtime_change_fun realtime_change_fun;
+	fd_context_set_timer_slack_fun set_timer_slack_fun;
 };
 
 errno_t fd_context_default_read(FileDescription *desc, int kq, /**/
@@ -67,6 +72,8 @@ void epoll_shim_ctx_install_desc(EpollShimCtx *epoll_shim_ctx, /**/
 FileDescription *epoll_shim_ctx_find_desc(EpollShimCtx *epoll_shim_ctx, int fd);
 void epoll_shim_ctx_drop_desc(EpollShimCtx *epoll_shim_ctx, /**/
     int fd, FileDescription *desc);
+errno_t epoll_shim_ctx_add_watcher(EpollShimCtx *epoll_shim_ctx, /**/
+    int efd, int fd2);
 
 void
 epoll_shim_ctx_update_realtime_change_monitoring(EpollShimCtx *epoll_shim_ctx,
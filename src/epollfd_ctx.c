@@ -23,34 +23,139 @@
 
 #include "wrap.h"
 
+_Static_assert(sizeof(RegisteredFDsNode) <= 64, "");
+
+static void
+registered_fds_slab_init(RegisteredFDsSlab *slab)
+{
+	LIST_INIT(&slab->chunks);
+	slab->spare_chunk = NULL;
+}
+
+static void
+registered_fds_slab_terminate(RegisteredFDsSlab *slab)
+{
+	assert(LIST_EMPTY(&slab->chunks));
+	free(slab->spare_chunk);
+}
+
+static RegisteredFDsNode *
+registered_fds_slab_alloc(RegisteredFDsSlab *slab,
+    RegisteredFDsChunk **chunk_out)
+{
+	RegisteredFDsChunk *chunk = LIST_FIRST(&slab->chunks);
+
+	if (!chunk) {
+		if (slab->spare_chunk) {
+			chunk = slab->spare_chunk;
+			slab->spare_chunk = NULL;
+		} else {
+			void *mem;
+			if (posix_memalign(&mem, _Alignof(RegisteredFDsChunk),
+				sizeof(RegisteredFDsChunk)) != 0) {
+				return NULL;
+			}
+			chunk = mem;
+		}
+
+		SLIST_INIT(&chunk->free_nodes);
+		chunk->nr_used = 0;
+		chunk->nr_initialized = 0;
+		LIST_INSERT_HEAD(&slab->chunks, chunk, entry);
+	}
+
+	RegisteredFDsNode *node = SLIST_FIRST(&chunk->free_nodes);
+	if (node) {
+		SLIST_REMOVE_HEAD(&chunk->free_nodes, free_list_entry);
+	} else {
+		assert(chunk->nr_initialized < REGISTERED_FDS_CHUNK_NODES);
+		node = &chunk->nodes[chunk->nr_initialized++];
+	}
+
+	if (++chunk->nr_used == REGISTERED_FDS_CHUNK_NODES) {
+		LIST_REMOVE(chunk, entry);
+	}
+
+	*chunk_out = chunk;
+	return node;
+}
+
+static void
+registered_fds_slab_free(RegisteredFDsSlab *slab, RegisteredFDsNode *node)
+{
+	RegisteredFDsChunk *chunk = node->chunk;
+
+	assert(chunk->nr_used > 0);
+
+	if (chunk->nr_used-- == REGISTERED_FDS_CHUNK_NODES) {
+		LIST_INSERT_HEAD(&slab->chunks, chunk, entry);
+	}
+
+	if (chunk->nr_used != 0) {
+		SLIST_INSERT_HEAD(&chunk->free_nodes, node, free_list_entry);
+		return;
+	}
+
+	LIST_REMOVE(chunk, entry);
+
+	if (slab->spare_chunk) {
+		free(chunk);
+	} else {
+		slab->spare_chunk = chunk;
+	}
+}
+
 static RegisteredFDsNode *
-registered_fds_node_create(int fd)
+registered_fds_node_create(RegisteredFDsSlab *slab, int fd)
 {
+	RegisteredFDsChunk *chunk;
 	RegisteredFDsNode *node;
 
-	node = malloc(sizeof(*node));
+	node = registered_fds_slab_alloc(slab, &chunk);
 	if (!node) {
 		return NULL;
 	}
 
-	*node = (RegisteredFDsNode) { .fd = fd, .self_pipe = { -1, -1 } };
+	*node = (RegisteredFDsNode) { .fd = fd, .chunk = chunk };
 
 	return node;
 }
 
+static RegisteredFDsNodeCold *
+registered_fds_node_get_cold(RegisteredFDsNode *node)
+{
+	if (!node->cold) {
+		node->cold = malloc(sizeof(*node->cold));
+		if (!node->cold) {
+			return NULL;
+		}
+
+		*node->cold = (RegisteredFDsNodeCold) {
+			.node = node,
+			.self_pipe = { -1, -1 },
+		};
+	}
+
+	return node->cold;
+}
+
 static void
-registered_fds_node_destroy(RegisteredFDsNode *node)
+registered_fds_node_destroy(RegisteredFDsSlab *slab, RegisteredFDsNode *node)
 {
 	if (node->node_type == NODE_TYPE_KQUEUE) {
 		pollable_desc_unref(node->node_data.kqueue.pollable_desc);
 	}
 
-	if (node->self_pipe[0] >= 0 && node->self_pipe[1] >= 0) {
-		(void)real_close(node->self_pipe[0]);
-		(void)real_close(node->self_pipe[1]);
+	if (node->cold) {
+		if (node->cold->self_pipe[0] >= 0 &&
+		    node->cold->self_pipe[1] >= 0) {
+			(void)real_close(node->cold->self_pipe[0]);
+			(void)real_close(node->cold->self_pipe[1]);
+		}
+		free(node->cold);
 	}
 
-	free(node);
+	registered_fds_slab_free(slab, node);
 }
 
 typedef struct {
@@ -221,6 +326,7 @@ registered_fds_node_update_flags_from_epoll_event(RegisteredFDsNode *fd2_node,
 	fd2_node->data = ev->data;
 	fd2_node->is_edge_triggered = ev->events & EPOLLET;
 	fd2_node->is_oneshot = ev->events & EPOLLONESHOT;
+	fd2_node->is_exclusive = ev->events & EPOLLEXCLUSIVE;
 
 	if (fd2_node->is_oneshot) {
 		fd2_node->is_edge_triggered = true;
@@ -236,18 +342,23 @@ registered_fds_node_add_self_trigger(RegisteredFDsNode *fd2_node, int kq)
 	EV_SET(&kevs[0], (uintptr_t)fd2_node, EVFILT_USER, /**/
 	    EV_ADD | EV_CLEAR, 0, 0, fd2_node);
 #else
-	if (fd2_node->self_pipe[0] < 0 && fd2_node->self_pipe[1] < 0) {
-		if (pipe2(fd2_node->self_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+	RegisteredFDsNodeCold *cold = registered_fds_node_get_cold(fd2_node);
+	if (!cold) {
+		return ENOMEM;
+	}
+
+	if (cold->self_pipe[0] < 0 && cold->self_pipe[1] < 0) {
+		if (pipe2(cold->self_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
 			errno_t ec = errno;
-			fd2_node->self_pipe[0] = fd2_node->self_pipe[1] = -1;
+			cold->self_pipe[0] = cold->self_pipe[1] = -1;
 			return ec;
 		}
 
-		assert(fd2_node->self_pipe[0] >= 0);
-		assert(fd2_node->self_pipe[1] >= 0);
+		assert(cold->self_pipe[0] >= 0);
+		assert(cold->self_pipe[1] >= 0);
 	}
 
-	EV_SET(&kevs[0], (unsigned int)fd2_node->self_pipe[0], EVFILT_READ, /**/
+	EV_SET(&kevs[0], (unsigned int)cold->self_pipe[0], EVFILT_READ, /**/
 	    EV_ADD | EV_CLEAR, 0, 0, fd2_node);
 #endif
 
@@ -268,17 +379,119 @@ registered_fds_node_trigger_self(RegisteredFDsNode *fd2_node, int kq)
 	(void)kevent(kq, kevs, 1, NULL, 0, NULL);
 #else
 	(void)kq;
-	assert(fd2_node->self_pipe[1] >= 0);
+	assert(fd2_node->cold != NULL);
+	assert(fd2_node->cold->self_pipe[1] >= 0);
 
 	char c = 0;
-	(void)write(fd2_node->self_pipe[1], &c, 1);
+	(void)write(fd2_node->cold->self_pipe[1], &c, 1);
+#endif
+}
+
+static bool
+registered_fds_node_is_self_trigger_event(RegisteredFDsNode *fd2_node,
+    struct kevent const *kev)
+{
+#ifdef EVFILT_USER
+	(void)fd2_node;
+	return kev->filter == EVFILT_USER;
+#else
+	return fd2_node->cold && fd2_node->cold->self_pipe[0] >= 0 &&
+	    kev->ident == (uintptr_t)fd2_node->cold->self_pipe[0];
 #endif
 }
 
+/*
+ * EPOLLEXCLUSIVE registrations of the same socket and events in different
+ * epoll instances form a group. The socket filters are registered edge
+ * triggered in a kqueue of the group. Only the armed member watches that
+ * kqueue, and it consumes the events when reporting, so every readiness
+ * change wakes only one epoll instance. The arm is kept with a member that
+ * has blocking threads: it is passed on when the armed member reports an
+ * event or its last thread stops waiting, and it is claimed by a member
+ * that is about to block. Members are told to re-check whether they are
+ * armed through their self trigger.
+ */
+typedef struct exclusive_group_ {
+	LIST_ENTRY(exclusive_group_) entry;
+	int fd;
+	uint32_t events;
+	int kq;
+	TAILQ_HEAD(exclusive_group_members_, registered_fds_node_cold_) members;
+	RegisteredFDsNodeCold *armed;
+} ExclusiveGroup;
+
+static pthread_mutex_t exclusive_groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(exclusive_groups_, exclusive_group_) exclusive_groups =
+    LIST_HEAD_INITIALIZER(exclusive_groups);
+
+static bool
+exclusive_group_member_has_waiters(RegisteredFDsNodeCold *member)
+{
+	EpollFDCtx *epollfd = member->epollfd;
+
+	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
+	bool has_waiters = epollfd->nr_polling_threads != 0;
+	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
+
+	return has_waiters;
+}
+
+/*
+ * Must be called with 'exclusive_groups_mutex' held. Members stay valid
+ * until they have left the group, and 'kq' is the member's own duplicate
+ * of the kqueue, so the epoll instance may be closed concurrently.
+ */
+static bool
+exclusive_group_hand_over(ExclusiveGroup *group, RegisteredFDsNodeCold *member,
+    bool need_waiters)
+{
+	RegisteredFDsNodeCold *next = NULL;
+
+	for (RegisteredFDsNodeCold *np = member;;) {
+		np = TAILQ_NEXT(np, exclusive_group_entry);
+		if (!np) {
+			np = TAILQ_FIRST(&group->members);
+		}
+		if (np == member) {
+			break;
+		}
+
+		if (exclusive_group_member_has_waiters(np)) {
+			next = np;
+			break;
+		}
+		if (!next && !need_waiters) {
+			next = np;
+		}
+	}
+
+	if (!next) {
+		return false;
+	}
+
+	group->armed = next;
+	registered_fds_node_trigger_self(next->node, next->kq);
+	return true;
+}
+
+static int
+scratch_kq_get(int *scratch_kq)
+{
+	if (*scratch_kq < 0) {
+		*scratch_kq = kqueue1(O_CLOEXEC);
+	}
+
+	return *scratch_kq;
+}
+
 static void
 registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
-    struct kevent const *kev)
+    int *scratch_kq, struct kevent const *kev)
 {
+#if !defined(EVFILT_EXCEPT) || !defined(__APPLE__)
+	(void)scratch_kq;
+#endif
+
 	int revents = 0;
 
 	if (fd2_node->node_type == NODE_TYPE_POLL) {
@@ -288,7 +501,8 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 		assert(kev->filter == EVFILT_USER);
 #else
 		char c[32];
-		while (real_read(fd2_node->self_pipe[0], c, sizeof(c)) >= 0) {
+		while (real_read(fd2_node->cold->self_pipe[0], c, sizeof(c)) >=
+		    0) {
 		}
 #endif
 
@@ -306,13 +520,7 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 	}
 
 	if (fd2_node->node_type == NODE_TYPE_FIFO &&
-#ifdef EVFILT_USER
-	    kev->filter == EVFILT_USER
-#else
-	    (fd2_node->self_pipe[0] >= 0 &&
-		kev->ident == (uintptr_t)fd2_node->self_pipe[0])
-#endif
-	) {
+	    registered_fds_node_is_self_trigger_event(fd2_node, kev)) {
 		assert(fd2_node->revents == 0);
 
 		assert(!fd2_node->has_evfilt_read);
@@ -339,6 +547,8 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 			goto out;
 		} else {
 			fd2_node->has_evfilt_write = true;
+			fd2_node->is_evfilt_write_clear =
+			    (needed_filters.evfilt_write & EV_CLEAR) != 0;
 			return;
 		}
 	}
@@ -383,7 +593,7 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 			 * the EVFILT_EXCEPT filter if needed.
 			 */
 
-			int tmp_kq = kqueue();
+			int tmp_kq = scratch_kq_get(scratch_kq);
 			if (tmp_kq >= 0) {
 				struct kevent kev;
 				EV_SET(&kev, fd2_node->fd, EVFILT_EXCEPT,
@@ -409,7 +619,9 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 					need_reset = true;
 				}
 
-				real_close(tmp_kq);
+				EV_SET(&kev, fd2_node->fd, EVFILT_EXCEPT,
+				    EV_DELETE, 0, 0, 0);
+				(void)kevent(tmp_kq, &kev, 1, NULL, 0, NULL);
 
 				if (need_reset) {
 					EV_SET(&kev, fd2_node->fd,
@@ -438,13 +650,13 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node, int kq,
 			if (kev->flags & EV_EOF) {
 				fd2_node->eof_state |= EOF_STATE_READ_EOF;
 			} else {
-				fd2_node->eof_state &= ~EOF_STATE_READ_EOF;
+				fd2_node->eof_state &= (uint8_t)~EOF_STATE_READ_EOF;
 			}
 		} else if (kev->filter == EVFILT_WRITE) {
 			if (kev->flags & EV_EOF) {
 				fd2_node->eof_state |= EOF_STATE_WRITE_EOF;
 			} else {
-				fd2_node->eof_state &= ~EOF_STATE_WRITE_EOF;
+				fd2_node->eof_state &= (uint8_t)~EOF_STATE_WRITE_EOF;
 			}
 		}
 	} else {
@@ -566,11 +778,10 @@ out:
 	}
 }
 
-static void
-registered_fds_node_register_for_completion(int *kq,
+static int
+registered_fds_node_register_for_completion(struct kevent *kev,
     RegisteredFDsNode *fd2_node)
 {
-	struct kevent kev[3];
 	int n = 0;
 
 	if (fd2_node->has_evfilt_read && !fd2_node->got_evfilt_read) {
@@ -590,62 +801,348 @@ registered_fds_node_register_for_completion(int *kq,
 #endif
 	}
 
+	return n;
+}
+
+#define COMPLETION_KEVS_MAX 32
+
+static void
+registered_fds_node_complete(int *scratch_kq, struct kevent *kev, int n)
+{
+	assert(n <= COMPLETION_KEVS_MAX);
+
 	if (n == 0) {
 		return;
 	}
 
-	if (*kq < 0) {
-		*kq = kqueue1(O_CLOEXEC);
+	int kq = scratch_kq_get(scratch_kq);
+	if (kq < 0) {
+		return;
+	}
+
+	if (kevent(kq, kev, n, kev, n, NULL) < 0) {
+		return;
+	}
+
+	/* Every oneshot filter fires at most once, so this is enough. */
+	struct kevent kevs[COMPLETION_KEVS_MAX];
+	int nkevs = kevent(kq, /**/
+	    NULL, 0, kevs, COMPLETION_KEVS_MAX, &(struct timespec) { 0, 0 });
+
+	/* Leave the scratch kqueue empty for the next user. */
+	for (int i = 0; i < n; ++i) {
+		EV_SET(&kev[i], kev[i].ident, kev[i].filter,
+		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
+	}
+	(void)kevent(kq, kev, n, kev, n, NULL);
+
+	for (int i = 0; i < nkevs; ++i) {
+		RegisteredFDsNode *fd2_node =
+		    (RegisteredFDsNode *)kevs[i].udata;
+
+		registered_fds_node_feed_event(fd2_node, -1, scratch_kq,
+		    &kevs[i]);
+	}
+}
+
+static errno_t
+exclusive_group_create(ExclusiveGroup **group_out, int fd, uint32_t events)
+{
+	errno_t ec;
+
+	ExclusiveGroup *group = malloc(sizeof(*group));
+	if (!group) {
+		return ENOMEM;
+	}
+
+	if ((group->kq = kqueue1(O_CLOEXEC)) < 0) {
+		ec = errno;
+		goto out;
+	}
+
+	struct kevent kevs[2];
+	int n = 0;
+
+	if ((events & EPOLLIN) || !(events & EPOLLOUT)) {
+		EV_SET(&kevs[n++], (unsigned int)fd, EVFILT_READ,
+		    EV_ADD | EV_CLEAR, 0, 0, 0);
+	}
+	if (events & EPOLLOUT) {
+		EV_SET(&kevs[n++], (unsigned int)fd, EVFILT_WRITE,
+		    EV_ADD | EV_CLEAR, 0, 0, 0);
 	}
 
-	if (*kq >= 0) {
-		(void)kevent(*kq, kev, n, kev, n, NULL);
+	if (kevent(group->kq, kevs, n, NULL, 0, NULL) < 0) {
+		ec = errno;
+		(void)real_close(group->kq);
+		goto out;
 	}
+
+	group->fd = fd;
+	group->events = events;
+	TAILQ_INIT(&group->members);
+	group->armed = NULL;
+
+	*group_out = group;
+	return 0;
+
+out:
+	free(group);
+	return ec;
 }
 
+/* Only the armed member watches the kqueue of the group. */
 static void
-registered_fds_node_complete(int kq)
+registered_fds_node_set_exclusive_armed(RegisteredFDsNode *fd2_node,
+    bool is_armed)
 {
-	if (kq < 0) {
+	RegisteredFDsNodeCold *cold = fd2_node->cold;
+
+	if (fd2_node->is_exclusive_armed == is_armed) {
+		return;
+	}
+
+	struct kevent kevs[1];
+	EV_SET(&kevs[0], (unsigned int)cold->exclusive_group->kq, EVFILT_READ,
+	    is_armed ? EV_ADD : EV_DELETE, 0, 0, is_armed ? fd2_node : 0);
+
+	if (kevent(cold->kq, kevs, 1, NULL, 0, NULL) < 0 && is_armed) {
+		/* Let the next member that blocks take over. */
+		(void)pthread_mutex_lock(&exclusive_groups_mutex);
+		if (cold->exclusive_group->armed == cold) {
+			cold->exclusive_group->armed = NULL;
+		}
+		(void)pthread_mutex_unlock(&exclusive_groups_mutex);
 		return;
 	}
 
-	struct kevent kevs[32];
-	int n;
+	fd2_node->is_exclusive_armed = is_armed;
+}
 
-	while ((n = kevent(kq, /**/
-		    NULL, 0, kevs, 32, &(struct timespec) { 0, 0 })) > 0) {
-		for (int i = 0; i < n; ++i) {
-			RegisteredFDsNode *fd2_node =
-			    (RegisteredFDsNode *)kevs[i].udata;
+static errno_t
+epollfd_ctx__join_exclusive_group(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node)
+{
+	errno_t ec;
+
+	RegisteredFDsNodeCold *cold = registered_fds_node_get_cold(fd2_node);
+	if (!cold) {
+		return ENOMEM;
+	}
+
+	if ((ec = registered_fds_node_add_self_trigger(fd2_node, kq)) != 0) {
+		return ec;
+	}
+
+	if (epollfd->exclusive_kq < 0 &&
+	    (epollfd->exclusive_kq = real_fcntl(kq, F_DUPFD_CLOEXEC, 0)) < 0) {
+		return errno;
+	}
 
-			registered_fds_node_feed_event(fd2_node, -1, &kevs[i]);
+	uint32_t events = fd2_node->events & (EPOLLIN | EPOLLOUT);
+
+	(void)pthread_mutex_lock(&exclusive_groups_mutex);
+
+	ExclusiveGroup *group;
+	LIST_FOREACH (group, &exclusive_groups, entry) {
+		if (group->fd == fd2_node->fd && group->events == events) {
+			break;
+		}
+	}
+
+	if (!group) {
+		if ((ec = exclusive_group_create(&group, fd2_node->fd,
+			 events)) != 0) {
+			(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+			return ec;
 		}
+
+		LIST_INSERT_HEAD(&exclusive_groups, group, entry);
+	}
+
+	cold->exclusive_group = group;
+	cold->epollfd = epollfd;
+	cold->kq = epollfd->exclusive_kq;
+	cold->exclusive_recheck = false;
+	TAILQ_INSERT_TAIL(&group->members, cold, exclusive_group_entry);
+
+	bool is_armed = !group->armed;
+	if (is_armed) {
+		group->armed = cold;
+	}
+
+	(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+	TAILQ_INSERT_TAIL(&epollfd->exclusive_nodes, cold,
+	    exclusive_nodes_entry);
+
+	if (is_armed) {
+		registered_fds_node_set_exclusive_armed(fd2_node, true);
 	}
 
-	(void)real_close(kq);
+	return 0;
 }
 
-static int
-fd_cmp(RegisteredFDsNode *e1, RegisteredFDsNode *e2)
+static void
+epollfd_ctx__leave_exclusive_group(EpollFDCtx *epollfd,
+    RegisteredFDsNode *fd2_node)
+{
+	RegisteredFDsNodeCold *cold = fd2_node->cold;
+	ExclusiveGroup *group = cold->exclusive_group;
+
+	registered_fds_node_set_exclusive_armed(fd2_node, false);
+
+	(void)pthread_mutex_lock(&exclusive_groups_mutex);
+
+	if (group->armed == cold) {
+		if (exclusive_group_hand_over(group, cold, false)) {
+			/* Events this member consumed may still be pending. */
+			group->armed->exclusive_recheck = true;
+		} else {
+			group->armed = NULL;
+		}
+	}
+
+	TAILQ_REMOVE(&group->members, cold, exclusive_group_entry);
+	if (TAILQ_EMPTY(&group->members)) {
+		LIST_REMOVE(group, entry);
+		(void)real_close(group->kq);
+		free(group);
+	}
+
+	(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+	TAILQ_REMOVE(&epollfd->exclusive_nodes, cold, exclusive_nodes_entry);
+	cold->exclusive_group = NULL;
+}
+
+static RegisteredFDsLeaf *
+epollfd_ctx__find_leaf(EpollFDCtx *epollfd, unsigned int fd2)
+{
+	if ((fd2 >> REGISTERED_FDS_ROOT_SHIFT) >=
+	    epollfd->registered_fds_length) {
+		return NULL;
+	}
+
+	RegisteredFDsInner *inner =
+	    epollfd->registered_fds[fd2 >> REGISTERED_FDS_ROOT_SHIFT];
+	if (!inner) {
+		return NULL;
+	}
+
+	return inner->leaves[(fd2 >> REGISTERED_FDS_LEAF_BITS) &
+	    ((1U << REGISTERED_FDS_INNER_BITS) - 1)];
+}
+
+static RegisteredFDsNode *
+epollfd_ctx__find_node(EpollFDCtx *epollfd, int fd2)
+{
+	if (fd2 < 0) {
+		return NULL;
+	}
+
+	RegisteredFDsLeaf *leaf = epollfd_ctx__find_leaf(epollfd,
+	    (unsigned int)fd2);
+	if (!leaf) {
+		return NULL;
+	}
+
+	return leaf->nodes[(unsigned int)fd2 &
+	    ((1U << REGISTERED_FDS_LEAF_BITS) - 1)];
+}
+
+/* Returns the registered node with the lowest fd >= 'fd2', if any. */
+static RegisteredFDsNode *
+epollfd_ctx__next_node(EpollFDCtx *epollfd, unsigned int fd2)
 {
-	return (e1->fd < e2->fd) ? -1 : (e1->fd > e2->fd);
+	while ((fd2 >> REGISTERED_FDS_ROOT_SHIFT) <
+	    epollfd->registered_fds_length) {
+		RegisteredFDsLeaf *leaf = epollfd_ctx__find_leaf(epollfd, fd2);
+		if (!leaf) {
+			fd2 = ((fd2 >> REGISTERED_FDS_LEAF_BITS) + 1)
+			    << REGISTERED_FDS_LEAF_BITS;
+			continue;
+		}
+
+		RegisteredFDsNode *node =
+		    leaf->nodes[fd2 & ((1U << REGISTERED_FDS_LEAF_BITS) - 1)];
+		if (node) {
+			return node;
+		}
+		++fd2;
+	}
+
+	return NULL;
 }
 
-RB_PROTOTYPE_STATIC(registered_fds_set_, registered_fds_node_, entry, fd_cmp);
-RB_GENERATE_STATIC(registered_fds_set_, registered_fds_node_, entry, fd_cmp);
+static errno_t
+epollfd_ctx__insert_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
+{
+	unsigned int fd2 = (unsigned int)fd2_node->fd;
+	unsigned int root_index = fd2 >> REGISTERED_FDS_ROOT_SHIFT;
+
+	assert(fd2_node->fd >= 0);
+
+	if (root_index >= epollfd->registered_fds_length) {
+		unsigned int new_length = 1;
+		while (new_length <= root_index) {
+			new_length <<= 1;
+		}
+
+		RegisteredFDsInner **new_root = realloc(
+		    epollfd->registered_fds,
+		    new_length * sizeof(RegisteredFDsInner *));
+		if (!new_root) {
+			return errno;
+		}
+
+		memset(&new_root[epollfd->registered_fds_length], 0,
+		    (new_length - epollfd->registered_fds_length) *
+			sizeof(RegisteredFDsInner *));
+
+		epollfd->registered_fds = new_root;
+		epollfd->registered_fds_length = new_length;
+	}
+
+	RegisteredFDsInner **inner = &epollfd->registered_fds[root_index];
+	if (!*inner && !(*inner = calloc(1, sizeof(RegisteredFDsInner)))) {
+		return errno;
+	}
+
+	RegisteredFDsLeaf **leaf =
+	    &(*inner)->leaves[(fd2 >> REGISTERED_FDS_LEAF_BITS) &
+		((1U << REGISTERED_FDS_INNER_BITS) - 1)];
+	if (!*leaf && !(*leaf = calloc(1, sizeof(RegisteredFDsLeaf)))) {
+		return errno;
+	}
+
+	RegisteredFDsNode **slot =
+	    &(*leaf)->nodes[fd2 & ((1U << REGISTERED_FDS_LEAF_BITS) - 1)];
+	assert(*slot == NULL);
+	*slot = fd2_node;
+	++epollfd->registered_fds_size;
+
+	return 0;
+}
 
 errno_t
-epollfd_ctx_init(EpollFDCtx *epollfd)
+epollfd_ctx_init(EpollFDCtx *epollfd, int flags)
 {
 	errno_t ec;
 
 	*epollfd = (EpollFDCtx) {
-		.registered_fds = RB_INITIALIZER(&registered_fds),
+		.flags = flags,
 		.self_pipe = { -1, -1 },
+		.scratch_kq = -1,
+		.exclusive_kq = -1,
 	};
 
+	atomic_init(&epollfd->timer_slack_nanos, 0);
+
 	TAILQ_INIT(&epollfd->poll_fds);
+	TAILQ_INIT(&epollfd->exclusive_nodes);
+	SLIST_INIT(&epollfd->removed_nodes);
+	registered_fds_slab_init(&epollfd->registered_fds_slab);
 
 	if ((ec = pthread_mutex_init(&epollfd->nr_polling_threads_mutex,
 		 NULL)) != 0) {
@@ -667,25 +1164,61 @@ epollfd_ctx_terminate(EpollFDCtx *epollfd)
 	errno_t ec = 0;
 	errno_t ec_local;
 
+	/* Other members of exclusive groups may still look at us. */
+	RegisteredFDsNode *np;
+	RegisteredFDsNode *np_temp;
+	for (np = epollfd_ctx__next_node(epollfd, 0); np; np = np_temp) {
+		np_temp = epollfd_ctx__next_node(epollfd,
+		    (unsigned int)np->fd + 1);
+		if (np->cold && np->cold->exclusive_group) {
+			epollfd_ctx__leave_exclusive_group(epollfd, np);
+		}
+		registered_fds_node_destroy(&epollfd->registered_fds_slab, np);
+	}
+
 	ec_local = pthread_cond_destroy(&epollfd->nr_polling_threads_cond);
 	ec = ec ? ec : ec_local;
 	ec_local = pthread_mutex_destroy(&epollfd->nr_polling_threads_mutex);
 	ec = ec ? ec : ec_local;
 
-	RegisteredFDsNode *np;
-	RegisteredFDsNode *np_temp;
-	RB_FOREACH_SAFE (np, registered_fds_set_, &epollfd->registered_fds,
+	for (unsigned int i = 0; i < epollfd->registered_fds_length; ++i) {
+		RegisteredFDsInner *inner = epollfd->registered_fds[i];
+		if (!inner) {
+			continue;
+		}
+		for (unsigned int j = 0;
+		     j < (1U << REGISTERED_FDS_INNER_BITS); ++j) {
+			free(inner->leaves[j]);
+		}
+		free(inner);
+	}
+	free(epollfd->registered_fds);
+	SLIST_FOREACH_SAFE (np, &epollfd->removed_nodes, free_list_entry,
 	    np_temp) {
-		RB_REMOVE(registered_fds_set_, &epollfd->registered_fds, np);
-		registered_fds_node_destroy(np);
+		registered_fds_node_destroy(
+		    &epollfd->registered_fds_slab, np);
+	}
+	registered_fds_slab_terminate(&epollfd->registered_fds_slab);
+
+	KeventWaitBuf *buf;
+	while ((buf = epollfd->kevent_wait_bufs) != NULL) {
+		epollfd->kevent_wait_bufs = buf->next;
+		free(buf);
 	}
 
 	free(epollfd->kevs);
 	free(epollfd->pfds);
+	free(epollfd->deferred_changes);
 	if (epollfd->self_pipe[0] >= 0 && epollfd->self_pipe[1] >= 0) {
 		(void)real_close(epollfd->self_pipe[0]);
 		(void)real_close(epollfd->self_pipe[1]);
 	}
+	if (epollfd->scratch_kq >= 0) {
+		(void)real_close(epollfd->scratch_kq);
+	}
+	if (epollfd->exclusive_kq >= 0) {
+		(void)real_close(epollfd->exclusive_kq);
+	}
 
 	return ec;
 }
@@ -791,20 +1324,21 @@ epollfd_ctx__trigger_self(EpollFDCtx *epollfd, int kq)
 static void
 epollfd_ctx__trigger_repoll(EpollFDCtx *epollfd, int kq)
 {
+	/*
+	 * The caller holds the lock, so no new threads can start polling.
+	 * A trigger is consumed by only one of the threads blocking in
+	 * kevent(), so trigger again each time one of them leaves.
+	 */
 	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-	unsigned long nr_polling_threads = epollfd->nr_polling_threads;
-	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
-
-	if (nr_polling_threads == 0) {
-		return;
-	}
+	while (epollfd->nr_polling_threads != 0) {
+		unsigned long nr_polling_threads = epollfd->nr_polling_threads;
 
-	epollfd_ctx__trigger_self(epollfd, kq);
+		epollfd_ctx__trigger_self(epollfd, kq);
 
-	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-	while (epollfd->nr_polling_threads != 0) {
-		pthread_cond_wait(&epollfd->nr_polling_threads_cond,
-		    &epollfd->nr_polling_threads_mutex);
+		while (epollfd->nr_polling_threads >= nr_polling_threads) {
+			pthread_cond_wait(&epollfd->nr_polling_threads_cond,
+			    &epollfd->nr_polling_threads_mutex);
+		}
 	}
 	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
 
@@ -815,12 +1349,115 @@ epollfd_ctx__trigger_repoll(EpollFDCtx *epollfd, int kq)
 #endif
 }
 
+static bool
+registered_fds_node_is_armed_for(RegisteredFDsNode *fd2_node,
+    struct kevent const *kev)
+{
+	if (kev->ident != (uintptr_t)fd2_node->fd) {
+		/* Self trigger. */
+		return fd2_node->node_type != NODE_TYPE_POLL ||
+		    fd2_node->is_on_pollfd_list;
+	}
+
+	switch (kev->filter) {
+	case EVFILT_READ:
+		return fd2_node->has_evfilt_read;
+	case EVFILT_WRITE:
+		return fd2_node->has_evfilt_write;
+#ifdef EVFILT_EXCEPT
+	case EVFILT_EXCEPT:
+		return fd2_node->has_evfilt_except;
+#endif
+	default:
+		return true;
+	}
+}
+
+/*
+ * Registering a node is split into queueing its kevent changes and checking
+ * the receipts afterwards. This way the changes of many epoll_ctl operations
+ * can be submitted with a single kevent() call.
+ */
+typedef struct {
+	RegisteredFDsNode *fd2_node;
+	int op;
+	int changes_index;
+	int changes_count;
+	int evfilt_read_index;
+	int evfilt_write_index;
+} PendingCtl;
+
+/* At most 3 EV_DELETEs and 3 EV_ADDs per node. */
+#define PENDING_CTL_MAX_CHANGES 6
+
+#define DEFERRED_CHANGES_MAX 256
+
+static void
+epollfd_ctx__flush_deferred_changes(EpollFDCtx *epollfd, int kq)
+{
+	int n = epollfd->nr_deferred_changes;
+	if (n == 0) {
+		return;
+	}
+
+	epollfd->nr_deferred_changes = 0;
+
+	/* All deferred changes carry EV_RECEIPT. Errors are ignored. */
+	(void)kevent(kq, epollfd->deferred_changes, n,
+	    epollfd->deferred_changes, n, NULL);
+}
+
+static errno_t
+epollfd_ctx__defer_changes(EpollFDCtx *epollfd, int kq,
+    struct kevent const *changes, int nchanges)
+{
+	assert(nchanges <= DEFERRED_CHANGES_MAX);
+
+	if (!epollfd->deferred_changes) {
+		epollfd->deferred_changes = malloc(
+		    DEFERRED_CHANGES_MAX * sizeof(struct kevent));
+		if (!epollfd->deferred_changes) {
+			return errno;
+		}
+	}
+
+	if (epollfd->nr_deferred_changes + nchanges > DEFERRED_CHANGES_MAX) {
+		epollfd_ctx__flush_deferred_changes(epollfd, kq);
+	}
+
+	memcpy(&epollfd->deferred_changes[epollfd->nr_deferred_changes],
+	    changes, (size_t)nchanges * sizeof(struct kevent));
+	epollfd->nr_deferred_changes += nchanges;
+
+	return 0;
+}
+
+static void
+epollfd_ctx__reap_removed_nodes(EpollFDCtx *epollfd)
+{
+	if (epollfd->nr_kevent_waiters != 0 ||
+	    epollfd->nr_deferred_changes != 0) {
+		return;
+	}
+
+	RegisteredFDsNode *np;
+	while ((np = SLIST_FIRST(&epollfd->removed_nodes)) != NULL) {
+		SLIST_REMOVE_HEAD(&epollfd->removed_nodes, free_list_entry);
+		registered_fds_node_destroy(&epollfd->registered_fds_slab, np);
+	}
+}
+
 static void
 epollfd_ctx__remove_node_from_kq(EpollFDCtx *epollfd, int kq,
-    RegisteredFDsNode *fd2_node)
+    RegisteredFDsNode *fd2_node, struct kevent *changes, int *nchanges)
 {
+	if (!changes) {
+		epollfd_ctx__flush_deferred_changes(epollfd, kq);
+	}
+
 	if (fd2_node->is_on_pollfd_list) {
-		TAILQ_REMOVE(&epollfd->poll_fds, fd2_node, pollfd_list_entry);
+		TAILQ_REMOVE(&epollfd->poll_fds, fd2_node->cold,
+		    pollfd_list_entry);
 		fd2_node->is_on_pollfd_list = false;
 		assert(epollfd->poll_fds_size != 0);
 		--epollfd->poll_fds_size;
@@ -828,50 +1465,96 @@ epollfd_ctx__remove_node_from_kq(EpollFDCtx *epollfd, int kq,
 		epollfd_ctx__trigger_repoll(epollfd, kq);
 	}
 
-	if (fd2_node->self_pipe[0] >= 0) {
+	if (fd2_node->cold && fd2_node->cold->self_pipe[0] >= 0) {
+		int self_pipe = fd2_node->cold->self_pipe[0];
+
 		struct kevent kevs[1];
-		EV_SET(&kevs[0], (unsigned int)fd2_node->self_pipe[0],
-		    EVFILT_READ, EV_DELETE, 0, 0, 0);
+		EV_SET(&kevs[0], (unsigned int)self_pipe, EVFILT_READ,
+		    EV_DELETE, 0, 0, 0);
 		(void)kevent(kq, kevs, 1, NULL, 0, NULL);
 
 		char c[32];
-		while (real_read(fd2_node->self_pipe[0], c, sizeof(c)) >= 0) {
+		while (real_read(self_pipe, c, sizeof(c)) >= 0) {
 		}
 	}
 
+	struct kevent kevs[3];
+	int n = 0;
+
 	if (fd2_node->node_type == NODE_TYPE_POLL) {
 #ifdef EVFILT_USER
-		struct kevent kevs[1];
-		EV_SET(&kevs[0], (uintptr_t)fd2_node, EVFILT_USER, /**/
-		    EV_DELETE, 0, 0, 0);
-		(void)kevent(kq, kevs, 1, NULL, 0, NULL);
+		EV_SET(&kevs[n++], (uintptr_t)fd2_node, EVFILT_USER, /**/
+		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
 #endif
 	} else {
-		struct kevent kevs[3];
 		int fd2 = fd2_node->fd;
 
-		EV_SET(&kevs[0], (unsigned int)fd2, EVFILT_READ, /**/
+		EV_SET(&kevs[n++], (unsigned int)fd2, EVFILT_READ, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
-		EV_SET(&kevs[1], (unsigned int)fd2, EVFILT_WRITE, /**/
+		EV_SET(&kevs[n++], (unsigned int)fd2, EVFILT_WRITE, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
 #ifdef EVFILT_USER
-		EV_SET(&kevs[2], (uintptr_t)fd2_node, EVFILT_USER, /**/
+		EV_SET(&kevs[n++], (uintptr_t)fd2_node, EVFILT_USER, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
 #endif
-		(void)kevent(kq, kevs, 3, kevs, 3, NULL);
 
 		fd2_node->has_evfilt_read = false;
 		fd2_node->has_evfilt_write = false;
 		fd2_node->has_evfilt_except = false;
 	}
+
+	if (changes) {
+		memcpy(&changes[*nchanges], kevs, (size_t)n * sizeof(kevs[0]));
+		*nchanges += n;
+	} else if (n > 0) {
+		(void)kevent(kq, kevs, n, kevs, n, NULL);
+	}
 }
 
-static errno_t
-epollfd_ctx__register_events(EpollFDCtx *epollfd, int kq,
-    RegisteredFDsNode *fd2_node)
+static int
+registered_filter_mode(bool is_clear)
 {
-	errno_t ec = 0;
+	return is_clear ? EV_CLEAR : 1;
+}
+
+static void
+registered_fds_node_delete_changed_filters(RegisteredFDsNode *fd2_node,
+    NeededFilters const *needed_filters, struct kevent *changes,
+    int *nchanges)
+{
+	unsigned int fd2 = (unsigned int)fd2_node->fd;
+
+	if (fd2_node->has_evfilt_read &&
+	    needed_filters->evfilt_read !=
+		registered_filter_mode(fd2_node->is_evfilt_read_clear)) {
+		EV_SET(&changes[(*nchanges)++], fd2, EVFILT_READ,
+		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
+		fd2_node->has_evfilt_read = false;
+	}
+	if (fd2_node->has_evfilt_write &&
+	    needed_filters->evfilt_write !=
+		registered_filter_mode(fd2_node->is_evfilt_write_clear)) {
+		EV_SET(&changes[(*nchanges)++], fd2, EVFILT_WRITE,
+		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
+		fd2_node->has_evfilt_write = false;
+	}
+#ifdef EVFILT_EXCEPT
+	if (fd2_node->has_evfilt_except &&
+	    needed_filters->evfilt_except !=
+		registered_filter_mode(
+		    fd2_node->is_evfilt_except_clear)) {
+		EV_SET(&changes[(*nchanges)++], fd2, EVFILT_EXCEPT,
+		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
+		fd2_node->has_evfilt_except = false;
+	}
+#endif
+}
 
+static void
+epollfd_ctx__register_events_prepare(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node, struct kevent *changes, int *nchanges,
+    PendingCtl *pending)
+{
 	/* Only sockets support EPOLLRDHUP and EPOLLPRI. */
 	if (fd2_node->node_type != NODE_TYPE_SOCKET) {
 		fd2_node->events = (uint16_t)(/**/
@@ -881,93 +1564,135 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, int kq,
 	}
 
 	int const fd2 = fd2_node->fd;
-	struct kevent kev[4] = {
-		{ .data = 0 },
-		{ .data = 0 },
-		{ .data = 0 },
-		{ .data = 0 },
-	};
 
 	assert(fd2 >= 0);
 
-	int evfilt_read_index = -1;
-	int evfilt_write_index = -1;
+	pending->changes_count = 0;
+	pending->evfilt_read_index = -1;
+	pending->evfilt_write_index = -1;
 
 	if (fd2_node->node_type != NODE_TYPE_POLL) {
-		if (fd2_node->is_registered) {
-			epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node);
+		NeededFilters needed_filters = get_needed_filters(fd2_node);
+
+		if (fd2_node->cold && fd2_node->cold->exclusive_group) {
+			needed_filters = (NeededFilters) { 0, 0, 0 };
 		}
 
-		int n = 0;
+#ifdef __APPLE__
+		/*
+		 * On macOS EVFILT_EXCEPT also triggers on normal data, so we
+		 * must set the filter to edge triggered in all cases.
+		 * Otherwise we will get swamped by events.
+		 */
+		if (needed_filters.evfilt_except) {
+			needed_filters.evfilt_except = EV_CLEAR;
+		}
+#endif
 
-		assert(!fd2_node->has_evfilt_read);
-		assert(!fd2_node->has_evfilt_write);
-		assert(!fd2_node->has_evfilt_except);
+		if (fd2_node->is_registered) {
+			/* FIFOs at EOF may have a self trigger registered. */
+			if (fd2_node->node_type == NODE_TYPE_FIFO &&
+			    fd2_node->eof_state) {
+				epollfd_ctx__remove_node_from_kq(epollfd, kq,
+				    fd2_node, changes, nchanges);
+			} else {
+				registered_fds_node_delete_changed_filters(
+				    fd2_node, &needed_filters, /**/
+				    changes, nchanges);
+			}
+		}
 
-		NeededFilters needed_filters = get_needed_filters(fd2_node);
+		struct kevent *kev = &changes[*nchanges];
+		int n = 0;
 
-		if (needed_filters.evfilt_read) {
+		/*
+		 * Filters that are already registered with the right mode
+		 * are left alone, unless they are edge triggered. EV_ADD
+		 * re-evaluates the filter, which is needed to report still
+		 * pending events after EPOLL_CTL_MOD.
+		 */
+		if (needed_filters.evfilt_read &&
+		    (!fd2_node->has_evfilt_read ||
+			fd2_node->is_edge_triggered)) {
 			fd2_node->has_evfilt_read = true;
-			evfilt_read_index = n;
+			fd2_node->is_evfilt_read_clear =
+			    (needed_filters.evfilt_read & EV_CLEAR) != 0;
+			pending->evfilt_read_index = n;
 			EV_SET(&kev[n++], (unsigned int)fd2, EVFILT_READ,
-			    (unsigned short)(EV_ADD |
+			    (unsigned short)(EV_ADD | EV_RECEIPT |
 				(needed_filters.evfilt_read & EV_CLEAR)),
 			    0, 0, fd2_node);
 		}
-		if (needed_filters.evfilt_write) {
+		if (needed_filters.evfilt_write &&
+		    (!fd2_node->has_evfilt_write ||
+			fd2_node->is_edge_triggered)) {
 			fd2_node->has_evfilt_write = true;
-			evfilt_write_index = n;
+			fd2_node->is_evfilt_write_clear =
+			    (needed_filters.evfilt_write & EV_CLEAR) != 0;
+			pending->evfilt_write_index = n;
 			EV_SET(&kev[n++], (unsigned int)fd2, EVFILT_WRITE,
-			    (unsigned short)(EV_ADD |
+			    (unsigned short)(EV_ADD | EV_RECEIPT |
 				(needed_filters.evfilt_write & EV_CLEAR)),
 			    0, 0, fd2_node);
 		}
-
-		assert(n != 0);
-
-		if (needed_filters.evfilt_except) {
+		if (needed_filters.evfilt_except &&
+		    (!fd2_node->has_evfilt_except ||
+			fd2_node->is_edge_triggered)) {
 #ifdef EVFILT_EXCEPT
 			fd2_node->has_evfilt_except = true;
+			fd2_node->is_evfilt_except_clear =
+			    (needed_filters.evfilt_except & EV_CLEAR) != 0;
 			EV_SET(&kev[n++], (unsigned int)fd2, EVFILT_EXCEPT,
-			    EV_ADD |
-#ifdef __APPLE__
-				/*
-				 * On macOS EVFILT_EXCEPT also triggers on
-				 * normal data, so we must set the filter to
-				 * edge triggered in all cases. Otherwise we
-				 * will get swamped by events.
-				 */
-				EV_CLEAR
-#else
-				(needed_filters.evfilt_except & EV_CLEAR)
-#endif
-			    ,
+			    (unsigned short)(EV_ADD | EV_RECEIPT |
+				(needed_filters.evfilt_except & EV_CLEAR)),
 			    NOTE_OOB, 0, fd2_node);
 #else
 			assert(0);
 #endif
 		}
 
-		for (int i = 0; i < n; ++i) {
-			kev[i].flags |= EV_RECEIPT;
-		}
+		pending->changes_index = *nchanges;
+		pending->changes_count = n;
+		*nchanges += n;
+	}
+}
 
-		int ret = kevent(kq, kev, n, kev, n, NULL);
-		if (ret < 0) {
-			ec = errno;
-			goto out;
-		}
+static errno_t
+epollfd_ctx__submit_changes(EpollFDCtx *epollfd, int kq,
+    struct kevent *changes, int nchanges)
+{
+	if (nchanges == 0) {
+		return 0;
+	}
 
-		assert(ret == n);
+	epollfd_ctx__flush_deferred_changes(epollfd, kq);
 
-		for (int i = 0; i < n; ++i) {
-			assert((kev[i].flags & EV_ERROR) != 0);
-		}
+	int ret = kevent(kq, changes, nchanges, changes, nchanges, NULL);
+	if (ret < 0) {
+		return errno;
+	}
+
+	assert(ret == nchanges);
+
+	for (int i = 0; i < nchanges; ++i) {
+		assert((changes[i].flags & EV_ERROR) != 0);
 	}
 
+	return 0;
+}
+
+static errno_t
+epollfd_ctx__register_events_finish(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node, PendingCtl const *pending,
+    struct kevent const *changes)
+{
+	errno_t ec = 0;
+
+	struct kevent const *kev = &changes[pending->changes_index];
+
 	/* Check for fds that only support poll. */
 	if (((fd2_node->node_type == NODE_TYPE_OTHER &&
-		 kev[0].data == ENODEV) ||
+		 pending->changes_count > 0 && kev[0].data == ENODEV) ||
 		fd2_node->node_type == NODE_TYPE_POLL)) {
 
 		assert((fd2_node->events & /**/
@@ -987,12 +1712,19 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, int kq,
 		}
 
 		if (!fd2_node->is_on_pollfd_list) {
+			RegisteredFDsNodeCold *cold =
+			    registered_fds_node_get_cold(fd2_node);
+			if (!cold) {
+				ec = ENOMEM;
+				goto out;
+			}
+
 			if ((ec = epollfd_ctx__add_self_trigger(epollfd, /**/
 				 kq)) != 0) {
 				goto out;
 			}
 
-			TAILQ_INSERT_TAIL(&epollfd->poll_fds, fd2_node,
+			TAILQ_INSERT_TAIL(&epollfd->poll_fds, cold,
 			    pollfd_list_entry);
 			fd2_node->is_on_pollfd_list = true;
 			++epollfd->poll_fds_size;
@@ -1005,21 +1737,21 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, int kq,
 		goto out;
 	}
 
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < pending->changes_count; ++i) {
 		if (kev[i].data != 0) {
 			if ((kev[i].data == EPIPE
 #ifdef __NetBSD__
 				|| kev[i].data == EBADF
 #endif
 				) &&
-			    i == evfilt_write_index &&
+			    i == pending->evfilt_write_index &&
 			    fd2_node->node_type == NODE_TYPE_FIFO) {
 
 				fd2_node->eof_state = EOF_STATE_READ_EOF |
 				    EOF_STATE_WRITE_EOF;
 				fd2_node->has_evfilt_write = false;
 
-				if (evfilt_read_index < 0) {
+				if (!fd2_node->has_evfilt_read) {
 					if ((ec = registered_fds_node_add_self_trigger(
 						 fd2_node, kq)) != 0) {
 						goto out;
@@ -1041,17 +1773,67 @@ out:
 	return ec;
 }
 
-static void
-epollfd_ctx_remove_node(EpollFDCtx *epollfd, int kq,
+static errno_t
+epollfd_ctx__register_events(EpollFDCtx *epollfd, int kq,
     RegisteredFDsNode *fd2_node)
 {
-	epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node);
+	errno_t ec;
+
+	struct kevent changes[PENDING_CTL_MAX_CHANGES];
+	int nchanges = 0;
+	PendingCtl pending;
+
+	epollfd_ctx__register_events_prepare(epollfd, kq, fd2_node, /**/
+	    changes, &nchanges, &pending);
+
+	if ((ec = epollfd_ctx__submit_changes(epollfd, kq, changes,
+		 nchanges)) != 0) {
+		return ec;
+	}
+
+	return epollfd_ctx__register_events_finish(epollfd, kq, fd2_node,
+	    &pending, changes);
+}
+
+static void
+epollfd_ctx__unlink_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
+{
+	assert(epollfd_ctx__find_node(epollfd, fd2_node->fd) == fd2_node);
 
-	RB_REMOVE(registered_fds_set_, &epollfd->registered_fds, fd2_node);
+	if (fd2_node->cold && fd2_node->cold->exclusive_group) {
+		epollfd_ctx__leave_exclusive_group(epollfd, fd2_node);
+	}
+
+	unsigned int fd2 = (unsigned int)fd2_node->fd;
+	epollfd_ctx__find_leaf(epollfd, fd2)
+	    ->nodes[fd2 & ((1U << REGISTERED_FDS_LEAF_BITS) - 1)] = NULL;
 	assert(epollfd->registered_fds_size > 0);
 	--epollfd->registered_fds_size;
+}
+
+static void
+epollfd_ctx__release_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
+{
+	/* A thread blocking in kevent() might still hold events for it, or
+	 * the EV_DELETEs might not have been applied yet. */
+	if (epollfd->nr_kevent_waiters != 0 ||
+	    epollfd->nr_deferred_changes != 0) {
+		fd2_node->is_registered = false;
+		SLIST_INSERT_HEAD(&epollfd->removed_nodes, fd2_node,
+		    free_list_entry);
+		return;
+	}
 
-	registered_fds_node_destroy(fd2_node);
+	registered_fds_node_destroy(&epollfd->registered_fds_slab, fd2_node);
+}
+
+static void
+epollfd_ctx_remove_node(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node)
+{
+	epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node, NULL, NULL);
+	epollfd_ctx__unlink_node(epollfd, fd2_node);
+	epollfd_ctx__release_node(epollfd, fd2_node);
 }
 
 #if defined(__FreeBSD__)
@@ -1086,9 +1868,11 @@ modify_fifo_rights_from_capabilities(RegisteredFDsNode *fd2_node)
 static errno_t
 epollfd_ctx_add_node(EpollFDCtx *epollfd, int kq, int fd2,
     PollableDesc pollable_desc, struct epoll_event *ev,
-    struct stat const *statbuf)
+    struct stat const *statbuf, struct kevent *changes, int *nchanges,
+    PendingCtl *pending)
 {
-	RegisteredFDsNode *fd2_node = registered_fds_node_create(fd2);
+	RegisteredFDsNode *fd2_node = registered_fds_node_create(
+	    &epollfd->registered_fds_slab, fd2);
 	if (!fd2_node) {
 		return ENOMEM;
 	}
@@ -1117,7 +1901,6 @@ epollfd_ctx_add_node(EpollFDCtx *epollfd, int kq, int fd2,
 				fd2_node->node_data.kqueue.pollable_desc =
 				    pollable_desc;
 				pollable_desc_ref(pollable_desc);
-				pollable_desc_poll(pollable_desc, fd2, NULL);
 			}
 		} else {
 			fd2_node->node_type = NODE_TYPE_FIFO;
@@ -1125,7 +1908,8 @@ epollfd_ctx_add_node(EpollFDCtx *epollfd, int kq, int fd2,
 			int fl = real_fcntl(fd2, F_GETFL);
 			if (fl < 0) {
 				errno_t ec = errno;
-				registered_fds_node_destroy(fd2_node);
+				registered_fds_node_destroy(
+				    &epollfd->registered_fds_slab, fd2_node);
 				return ec;
 			}
 
@@ -1142,7 +1926,8 @@ epollfd_ctx_add_node(EpollFDCtx *epollfd, int kq, int fd2,
 			} else if (fl == O_RDONLY) {
 				fd2_node->node_data.fifo.readable = true;
 			} else {
-				registered_fds_node_destroy(fd2_node);
+				registered_fds_node_destroy(
+				    &epollfd->registered_fds_slab, fd2_node);
 				return EINVAL;
 			}
 		}
@@ -1156,36 +1941,60 @@ epollfd_ctx_add_node(EpollFDCtx *epollfd, int kq, int fd2,
 
 	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev);
 
-	void *colliding_node = RB_INSERT(registered_fds_set_,
-	    &epollfd->registered_fds, fd2_node);
-	(void)colliding_node;
-	assert(colliding_node == NULL);
-	++epollfd->registered_fds_size;
-
-	errno_t ec = epollfd_ctx__register_events(epollfd, kq, fd2_node);
+	errno_t ec = epollfd_ctx__insert_node(epollfd, fd2_node);
 	if (ec != 0) {
-		epollfd_ctx_remove_node(epollfd, kq, fd2_node);
+		registered_fds_node_destroy(
+		    &epollfd->registered_fds_slab, fd2_node);
 		return ec;
 	}
 
-	fd2_node->is_registered = true;
+	if (fd2_node->is_exclusive) {
+		/* Exclusive wakeups are only implemented for sockets. */
+		if (fd2_node->node_type != NODE_TYPE_SOCKET) {
+			fd2_node->is_exclusive_armed = true;
+		} else if ((ec = epollfd_ctx__join_exclusive_group(epollfd, kq,
+				fd2_node)) != 0) {
+			epollfd_ctx_remove_node(epollfd, kq, fd2_node);
+			return ec;
+		}
+	}
+
+	epollfd_ctx__register_events_prepare(epollfd, kq, fd2_node, /**/
+	    changes, nchanges, pending);
+	pending->fd2_node = fd2_node;
 
 	return 0;
 }
 
 static errno_t
 epollfd_ctx_modify_node(EpollFDCtx *epollfd, int kq,
-    RegisteredFDsNode *fd2_node, struct epoll_event *ev)
+    RegisteredFDsNode *fd2_node, struct epoll_event *ev,
+    struct kevent *changes, int *nchanges, PendingCtl *pending)
 {
+	if (fd2_node->is_exclusive) {
+		return EINVAL;
+	}
+
 	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev);
 
 	assert(fd2_node->is_registered);
 
-	errno_t ec = epollfd_ctx__register_events(epollfd, kq, fd2_node);
-	if (ec != 0) {
-		epollfd_ctx_remove_node(epollfd, kq, fd2_node);
-		return ec;
-	}
+	epollfd_ctx__register_events_prepare(epollfd, kq, fd2_node, /**/
+	    changes, nchanges, pending);
+	pending->fd2_node = fd2_node;
+
+	return 0;
+}
+
+static errno_t
+epollfd_ctx_delete_node(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node, struct kevent *changes, int *nchanges,
+    PendingCtl *pending)
+{
+	epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node, /**/
+	    changes, nchanges);
+	epollfd_ctx__unlink_node(epollfd, fd2_node);
+	pending->fd2_node = fd2_node;
 
 	return 0;
 }
@@ -1195,9 +2004,11 @@ epollfd_ctx_fill_pollfds(EpollFDCtx *epollfd, int kq, struct pollfd *pfds)
 {
 	pfds[0] = (struct pollfd) { .fd = kq, .events = POLLIN };
 
-	RegisteredFDsNode *poll_node;
+	RegisteredFDsNodeCold *poll_cold;
 	size_t i = 1;
-	TAILQ_FOREACH (poll_node, &epollfd->poll_fds, pollfd_list_entry) {
+	TAILQ_FOREACH (poll_cold, &epollfd->poll_fds, pollfd_list_entry) {
+		RegisteredFDsNode *poll_node = poll_cold->node;
+
 		pfds[i++] = (struct pollfd) {
 			.fd = poll_node->fd,
 			.events = poll_node->node_type == NODE_TYPE_POLL ?
@@ -1208,28 +2019,45 @@ epollfd_ctx_fill_pollfds(EpollFDCtx *epollfd, int kq, struct pollfd *pfds)
 }
 
 void
-epollfd_ctx_remove_fd(EpollFDCtx *epollfd, int kq, int fd2)
+epollfd_ctx_for_each_nested_desc(EpollFDCtx *epollfd,
+    void (*fun)(PollableDesc pollable_desc, void *arg), void *arg)
 {
-	RegisteredFDsNode *fd2_node;
-	{
-		RegisteredFDsNode find;
-		find.fd = fd2;
-
-		fd2_node = RB_FIND(registered_fds_set_, /**/
-		    &epollfd->registered_fds, &find);
+	for (RegisteredFDsNode *np = epollfd_ctx__next_node(epollfd, 0); np;
+	     np = epollfd_ctx__next_node(epollfd, (unsigned int)np->fd + 1)) {
+		if (np->node_type == NODE_TYPE_KQUEUE &&
+		    np->node_data.kqueue.pollable_desc.ptr) {
+			fun(np->node_data.kqueue.pollable_desc, arg);
+		}
 	}
+}
+
+void
+epollfd_ctx_poll(EpollFDCtx *epollfd, int kq)
+{
+	/* The readiness of the kqueue must reflect all changes. */
+	epollfd_ctx__flush_deferred_changes(epollfd, kq);
+}
+
+void
+epollfd_ctx_remove_fd(EpollFDCtx *epollfd, int kq, int fd2)
+{
+	RegisteredFDsNode *fd2_node = epollfd_ctx__find_node(epollfd, fd2);
 
 	if (fd2_node) {
 		epollfd_ctx_remove_node(epollfd, kq, fd2_node);
 	}
 }
 
-errno_t
-epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, int op, int fd2,
-    PollableDesc pollable_desc, struct epoll_event *ev)
+static errno_t
+epollfd_ctx__ctl_prepare(EpollFDCtx *epollfd, int kq, int op, int fd2,
+    PollableDesc pollable_desc, struct epoll_event *ev,
+    struct kevent *changes, int *nchanges, PendingCtl *pending)
 {
 	assert(op == EPOLL_CTL_DEL || ev != NULL);
 
+	pending->fd2_node = NULL;
+	pending->op = op;
+
 	if (kq == fd2) {
 		return EINVAL;
 	}
@@ -1239,19 +2067,20 @@ epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, int op, int fd2,
 		~(uint32_t)(EPOLLIN | EPOLLOUT | EPOLLRDHUP | /**/
 		    EPOLLPRI |		  /* unsupported by FreeBSD's kqueue! */
 		    EPOLLHUP | EPOLLERR | /**/
-		    EPOLLET | EPOLLONESHOT)))) {
+		    EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE)))) {
 		return EINVAL;
 	}
 
-	RegisteredFDsNode *fd2_node;
-	{
-		RegisteredFDsNode find;
-		find.fd = fd2;
-
-		fd2_node = RB_FIND(registered_fds_set_, /**/
-		    &epollfd->registered_fds, &find);
+	if (op != EPOLL_CTL_DEL && (ev->events & EPOLLEXCLUSIVE) &&
+	    (op != EPOLL_CTL_ADD ||
+		(ev->events &
+		    ~(uint32_t)(EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR |
+			EPOLLET | EPOLLEXCLUSIVE)))) {
+		return EINVAL;
 	}
 
+	RegisteredFDsNode *fd2_node = epollfd_ctx__find_node(epollfd, fd2);
+
 	struct stat statbuf;
 	if (fstat(fd2, &statbuf) < 0) {
 		errno_t ec = errno;
@@ -1271,16 +2100,18 @@ epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, int op, int fd2,
 	if (op == EPOLL_CTL_ADD) {
 		ec = fd2_node != NULL ?
 		    EEXIST :
-		    epollfd_ctx_add_node(epollfd, kq, /**/
-			/* */ fd2, pollable_desc, ev, &statbuf);
+		    epollfd_ctx_add_node(epollfd, kq, fd2, pollable_desc, ev,
+			&statbuf, changes, nchanges, pending);
 	} else if (op == EPOLL_CTL_DEL) {
 		ec = fd2_node == NULL ?
 		    ENOENT :
-		    (epollfd_ctx_remove_node(epollfd, kq, fd2_node), 0);
+		    epollfd_ctx_delete_node(epollfd, kq, fd2_node, /**/
+			changes, nchanges, pending);
 	} else if (op == EPOLL_CTL_MOD) {
 		ec = fd2_node == NULL ?
 		    ENOENT :
-		    epollfd_ctx_modify_node(epollfd, kq, fd2_node, ev);
+		    epollfd_ctx_modify_node(epollfd, kq, fd2_node, ev, /**/
+			changes, nchanges, pending);
 	} else {
 		ec = EINVAL;
 	}
@@ -1288,80 +2119,347 @@ epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, int op, int fd2,
 	return ec;
 }
 
-errno_t
-epollfd_ctx_wait(EpollFDCtx *epollfd, int kq, struct epoll_event *ev, int cnt,
-    int *actual_cnt)
+static errno_t
+epollfd_ctx__ctl_finish(EpollFDCtx *epollfd, int kq, PendingCtl *pending,
+    struct kevent const *changes, errno_t ec)
 {
-	errno_t ec;
+	RegisteredFDsNode *fd2_node = pending->fd2_node;
 
-	assert(cnt >= 1);
+	if (pending->op == EPOLL_CTL_DEL) {
+		epollfd_ctx__release_node(epollfd, fd2_node);
+		return 0;
+	}
+
+	if (ec == 0) {
+		ec = epollfd_ctx__register_events_finish(epollfd, kq, fd2_node,
+		    pending, changes);
+	}
 
-	ec = epollfd_ctx_make_pfds_space(epollfd);
 	if (ec != 0) {
+		epollfd_ctx_remove_node(epollfd, kq, fd2_node);
 		return ec;
 	}
 
-	epollfd_ctx_fill_pollfds(epollfd, kq, epollfd->pfds);
+	fd2_node->is_registered = true;
 
-	int n = real_poll(epollfd->pfds, /**/
-	    (nfds_t)(1 + epollfd->poll_fds_size), 0);
-	if (n < 0) {
-		return errno;
-	}
-	if (n == 0) {
-		*actual_cnt = 0;
-		return 0;
-	}
+	return 0;
+}
 
-	{
-		RegisteredFDsNode *poll_node, *tmp_poll_node;
-		size_t i = 1;
-		TAILQ_FOREACH_SAFE (poll_node, &epollfd->poll_fds,
-		    pollfd_list_entry, tmp_poll_node) {
-			struct pollfd *pfd = &epollfd->pfds[i++];
+static bool
+epollfd_ctx__can_defer_ctl(EpollFDCtx *epollfd, PendingCtl const *pending,
+    struct kevent const *changes, int nchanges)
+{
+	if (!(epollfd->flags & EPOLLFD_CTX_FLAG_DEFER_CTL)) {
+		return false;
+	}
 
-			if (pfd->revents & POLLNVAL) {
-				epollfd_ctx_remove_node(epollfd, kq, poll_node);
-			} else if (pfd->revents) {
-				registered_fds_node_trigger_self(poll_node, kq);
-			}
+	/*
+	 * The fd may be closed without our close() wrapper before the
+	 * changes are applied. Filters added then could end up on an
+	 * unrelated file that reused the fd number, so only changes that
+	 * remove or disable filters are deferred.
+	 */
+	for (int i = 0; i < nchanges; ++i) {
+		if (!(changes[i].flags & (EV_DELETE | EV_DISABLE))) {
+			return false;
 		}
 	}
 
 	/*
-	 * Each registered fd can produce a maximum of 3 kevents. If
-	 * the provided space in 'ev' is large enough to hold results
-	 * for all registered fds, provide enough space for the kevent
-	 * call as well. Add some wiggle room for the 'poll only fd'
-	 * notification mechanism.
+	 * EPOLL_CTL_ADD must be applied eagerly to detect poll-only fds
+	 * (ENODEV) and FIFOs without readers (EPIPE). Only sockets and
+	 * kqueues are known to accept any filter change.
 	 */
-	if ((size_t)cnt >= epollfd->registered_fds_size) {
-		if (__builtin_add_overflow(cnt, 1, &cnt)) {
-			return ENOMEM;
-		}
-		if (__builtin_mul_overflow(cnt, 3, &cnt)) {
-			return ENOMEM;
+	if (pending->op == EPOLL_CTL_MOD) {
+		if (pending->fd2_node->node_type != NODE_TYPE_SOCKET &&
+		    pending->fd2_node->node_type != NODE_TYPE_KQUEUE) {
+			return false;
 		}
+	} else if (pending->op != EPOLL_CTL_DEL) {
+		return false;
 	}
 
-	ec = epollfd_ctx_make_kevs_space(epollfd, (size_t)cnt);
+	/* Blocking threads would not pick up the changes. */
+	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
+	bool has_polling_threads = epollfd->nr_polling_threads != 0;
+	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
+
+	return !has_polling_threads;
+}
+
+errno_t
+epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, int op, int fd2,
+    PollableDesc pollable_desc, struct epoll_event *ev)
+{
+	errno_t ec;
+
+	struct kevent changes[PENDING_CTL_MAX_CHANGES];
+	int nchanges = 0;
+	PendingCtl pending;
+
+	ec = epollfd_ctx__ctl_prepare(epollfd, kq, op, fd2, pollable_desc, ev,
+	    changes, &nchanges, &pending);
 	if (ec != 0) {
 		return ec;
 	}
 
-again:;
+	/*
+	 * Deferred changes are assumed to succeed. Their receipts still
+	 * have a 'data' member of 0.
+	 */
+	if (!epollfd_ctx__can_defer_ctl(epollfd, &pending, changes,
+		nchanges) ||
+	    epollfd_ctx__defer_changes(epollfd, kq, changes, nchanges) != 0) {
+		ec = epollfd_ctx__submit_changes(epollfd, kq, changes,
+		    nchanges);
+	}
 
-	struct kevent *kevs = epollfd->kevs;
-	assert(kevs != NULL);
+	ec = epollfd_ctx__ctl_finish(epollfd, kq, &pending, changes, ec);
 
-	n = kevent(kq, NULL, 0, kevs, cnt, &(struct timespec) { 0, 0 });
-	if (n < 0) {
-		return errno;
+	epollfd_ctx__reap_removed_nodes(epollfd);
+
+	return ec;
+}
+
+#define CTL_BATCH_MAX_OPS 128
+
+errno_t
+epollfd_ctx_ctl_batch(EpollFDCtx *epollfd, int kq,
+    struct epoll_shim_ctl_op *ops, PollableDesc const *pollable_descs, int n,
+    int *nr_failed)
+{
+	errno_t ec;
+
+	*nr_failed = 0;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	ec = epollfd_ctx_make_kevs_space(epollfd,
+	    (size_t)MIN(n, CTL_BATCH_MAX_OPS) * PENDING_CTL_MAX_CHANGES);
+	if (ec != 0) {
+		return ec;
+	}
+
+	PendingCtl pendings[CTL_BATCH_MAX_OPS];
+	int pending_ops[CTL_BATCH_MAX_OPS];
+
+	for (int i = 0; i < n;) {
+		struct kevent *changes = epollfd->kevs;
+		int nchanges = 0;
+		int npending = 0;
+
+		for (; i < n && npending < CTL_BATCH_MAX_OPS; ++i) {
+			struct epoll_shim_ctl_op *op = &ops[i];
+
+			/*
+			 * The receipts for a node must have been checked
+			 * before it can be touched again.
+			 */
+			RegisteredFDsNode *fd2_node = epollfd_ctx__find_node(
+			    epollfd, op->fd);
+			if (fd2_node && fd2_node->is_ctl_pending) {
+				break;
+			}
+
+			PendingCtl *pending = &pendings[npending];
+
+			op->error = epollfd_ctx__ctl_prepare(epollfd, kq,
+			    op->op, op->fd, pollable_descs[i], &op->event,
+			    changes, &nchanges, pending);
+			if (op->error != 0) {
+				++*nr_failed;
+				continue;
+			}
+
+			pending->fd2_node->is_ctl_pending = true;
+			pending_ops[npending++] = i;
+		}
+
+		ec = epollfd_ctx__submit_changes(epollfd, kq, changes,
+		    nchanges);
+
+		for (int j = 0; j < npending; ++j) {
+			PendingCtl *pending = &pendings[j];
+			struct epoll_shim_ctl_op *op = &ops[pending_ops[j]];
+
+			pending->fd2_node->is_ctl_pending = false;
+
+			op->error = epollfd_ctx__ctl_finish(epollfd, kq,
+			    pending, changes, ec);
+			if (op->error != 0) {
+				++*nr_failed;
+			}
+		}
 	}
 
+	epollfd_ctx__reap_removed_nodes(epollfd);
+
+	return 0;
+}
+
+/* Returns true if the node must be checked for pending events. */
+static bool
+registered_fds_node_sync_exclusive(RegisteredFDsNode *fd2_node)
+{
+	RegisteredFDsNodeCold *cold = fd2_node->cold;
+
+#ifndef EVFILT_USER
+	char c[32];
+	while (real_read(cold->self_pipe[0], c, sizeof(c)) >= 0) {
+	}
+#endif
+
+	(void)pthread_mutex_lock(&exclusive_groups_mutex);
+	bool is_armed = cold->exclusive_group->armed == cold;
+	bool needs_recheck = cold->exclusive_recheck;
+	cold->exclusive_recheck = false;
+	(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+	registered_fds_node_set_exclusive_armed(fd2_node, is_armed);
+
+	return needs_recheck;
+}
+
+/*
+ * Consumed events are gone for good, so level triggered nodes have to
+ * check the socket again on the next wait.
+ */
+static void
+registered_fds_node_recheck_exclusive(RegisteredFDsNode *fd2_node)
+{
+	struct pollfd pfd = {
+		.fd = fd2_node->fd,
+		.events = (short)(fd2_node->events & (EPOLLIN | EPOLLOUT)),
+	};
+
+	int revents = real_poll(&pfd, 1, 0) < 0 ? EPOLLERR : pfd.revents;
+
+	fd2_node->revents = revents & POLLNVAL ? 0 : (uint32_t)revents;
+	fd2_node->revents &= (fd2_node->events | EPOLLHUP | EPOLLERR);
+}
+
+static void
+epollfd_ctx__consume_exclusive_node(EpollFDCtx *epollfd, int kq,
+    RegisteredFDsNode *fd2_node)
+{
+	struct kevent kevs[2];
+	int n = kevent(fd2_node->cold->exclusive_group->kq, NULL, 0, kevs, 2,
+	    &(struct timespec) { 0, 0 });
+
+	for (int i = 0; i < n; ++i) {
+		registered_fds_node_feed_event(fd2_node, kq,
+		    &epollfd->scratch_kq, &kevs[i]);
+	}
+}
+
+static void
+registered_fds_node_pass_exclusive(RegisteredFDsNode *fd2_node, int kq)
+{
+	RegisteredFDsNodeCold *cold = fd2_node->cold;
+
+	(void)pthread_mutex_lock(&exclusive_groups_mutex);
+	bool is_passed = cold->exclusive_group->armed == cold &&
+	    exclusive_group_hand_over(cold->exclusive_group, cold, true);
+	if (!fd2_node->is_edge_triggered) {
+		cold->exclusive_recheck = true;
+	}
+	(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+	if (is_passed) {
+		registered_fds_node_set_exclusive_armed(fd2_node, false);
+	}
+
+	if (!fd2_node->is_edge_triggered) {
+		registered_fds_node_trigger_self(fd2_node, kq);
+	}
+}
+
+void
+epollfd_ctx_claim_exclusive_nodes(EpollFDCtx *epollfd, int kq)
+{
+	(void)kq;
+
+	RegisteredFDsNodeCold *cold;
+	TAILQ_FOREACH (cold, &epollfd->exclusive_nodes, exclusive_nodes_entry) {
+		RegisteredFDsNode *fd2_node = cold->node;
+
+		if (fd2_node->is_exclusive_armed) {
+			continue;
+		}
+
+		/*
+		 * Take over if the armed member has nobody waiting. The
+		 * calling thread already counts as waiting, so a member that
+		 * stops waiting at the same time hands the arm over to us.
+		 */
+		(void)pthread_mutex_lock(&exclusive_groups_mutex);
+		RegisteredFDsNodeCold *armed = cold->exclusive_group->armed;
+		bool is_claimed = armed != cold &&
+		    (!armed || !exclusive_group_member_has_waiters(armed));
+		if (is_claimed) {
+			cold->exclusive_group->armed = cold;
+			if (armed) {
+				registered_fds_node_trigger_self(armed->node,
+				    armed->kq);
+			}
+		}
+		(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+		if (is_claimed || armed == cold) {
+			registered_fds_node_set_exclusive_armed(fd2_node, true);
+		}
+	}
+}
+
+void
+epollfd_ctx_release_exclusive_nodes(EpollFDCtx *epollfd, int kq)
+{
+	(void)kq;
+
+	if (TAILQ_EMPTY(&epollfd->exclusive_nodes)) {
+		return;
+	}
+
+	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
+	bool has_waiters = epollfd->nr_polling_threads != 0;
+	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
+
+	if (has_waiters) {
+		return;
+	}
+
+	RegisteredFDsNodeCold *cold;
+	TAILQ_FOREACH (cold, &epollfd->exclusive_nodes, exclusive_nodes_entry) {
+		(void)pthread_mutex_lock(&exclusive_groups_mutex);
+		bool is_passed = cold->exclusive_group->armed == cold &&
+		    exclusive_group_hand_over(cold->exclusive_group, cold,
+			true);
+		(void)pthread_mutex_unlock(&exclusive_groups_mutex);
+
+		if (is_passed) {
+			registered_fds_node_set_exclusive_armed(cold->node,
+			    false);
+		}
+	}
+}
+
+static int
+epollfd_ctx__feed_kevents(EpollFDCtx *epollfd, int kq, struct kevent *kevs,
+    int n, int cnt, struct epoll_event *ev)
+{
 	int j = 0;
 
+	/* Changes deferred after 'kevs' were harvested go first. */
+	epollfd_ctx__flush_deferred_changes(epollfd, kq);
+
 	for (int i = 0; i < n; ++i) {
+		/* Receipts of deferred changes. */
+		if (kevs[i].flags & EV_ERROR) {
+			continue;
+		}
+
 		RegisteredFDsNode *fd2_node =
 		    (RegisteredFDsNode *)kevs[i].udata;
 
@@ -1375,10 +2473,41 @@ again:;
 			continue;
 		}
 
+		/*
+		 * Removed or disarmed while we were blocking in kevent().
+		 * Other threads may have harvested other filters of the same
+		 * node, e.g. of an EPOLLONESHOT node.
+		 */
+		if (!fd2_node->is_registered ||
+		    !registered_fds_node_is_armed_for(fd2_node, &kevs[i])) {
+			continue;
+		}
+
 		uint32_t old_revents = fd2_node->revents;
+
+		if (fd2_node->cold && fd2_node->cold->exclusive_group) {
+			if (registered_fds_node_is_self_trigger_event(fd2_node,
+				&kevs[i])) {
+				if (!registered_fds_node_sync_exclusive(
+					fd2_node)) {
+					continue;
+				}
+				registered_fds_node_recheck_exclusive(fd2_node);
+			} else if (fd2_node->is_exclusive_armed) {
+				epollfd_ctx__consume_exclusive_node(epollfd,
+				    kq, fd2_node);
+			}
+
+			if (fd2_node->revents && !old_revents) {
+				ev[j++].data.ptr = fd2_node;
+			}
+			continue;
+		}
+
 		NeededFilters old_needed_filters = get_needed_filters(fd2_node);
 
-		registered_fds_node_feed_event(fd2_node, kq, &kevs[i]);
+		registered_fds_node_feed_event(fd2_node, kq,
+		    &epollfd->scratch_kq, &kevs[i]);
 
 		if (fd2_node->node_type != NODE_TYPE_POLL &&
 		    !(fd2_node->is_edge_triggered &&
@@ -1397,7 +2526,7 @@ again:;
 				if (epollfd_ctx__register_events(epollfd, kq,
 					fd2_node) != 0) {
 					epollfd_ctx__remove_node_from_kq(
-					    epollfd, kq, fd2_node);
+					    epollfd, kq, fd2_node, NULL, NULL);
 				}
 			}
 		}
@@ -1408,19 +2537,30 @@ again:;
 	}
 
 	{
-		int completion_kq = -1;
+		struct kevent completion_kevs[COMPLETION_KEVS_MAX];
+		int completion_n = 0;
 
 		for (int i = 0; i < j; ++i) {
 			RegisteredFDsNode *fd2_node =
 			    (RegisteredFDsNode *)ev[i].data.ptr;
 
 			if (n == cnt || fd2_node->is_edge_triggered) {
-				registered_fds_node_register_for_completion(
-				    &completion_kq, fd2_node);
+				if (completion_n + 3 > COMPLETION_KEVS_MAX) {
+					registered_fds_node_complete(
+					    &epollfd->scratch_kq,
+					    completion_kevs, completion_n);
+					completion_n = 0;
+				}
+
+				completion_n +=
+				    registered_fds_node_register_for_completion(
+					&completion_kevs[completion_n],
+					fd2_node);
 			}
 		}
 
-		registered_fds_node_complete(completion_kq);
+		registered_fds_node_complete(&epollfd->scratch_kq,
+		    completion_kevs, completion_n);
 	}
 
 	for (int i = 0; i < j; ++i) {
@@ -1436,14 +2576,196 @@ again:;
 		fd2_node->got_evfilt_except = false;
 
 		if (fd2_node->is_oneshot) {
-			epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node);
+			epollfd_ctx__remove_node_from_kq(epollfd, kq, fd2_node,
+			    NULL, NULL);
+		} else if (fd2_node->cold && fd2_node->cold->exclusive_group) {
+			registered_fds_node_pass_exclusive(fd2_node, kq);
+		}
+	}
+
+	return j;
+}
+
+errno_t
+epollfd_ctx_wait(EpollFDCtx *epollfd, int kq, struct epoll_event *ev, int cnt,
+    int *actual_cnt)
+{
+	errno_t ec;
+
+	assert(cnt >= 1);
+
+	ec = epollfd_ctx_make_pfds_space(epollfd);
+	if (ec != 0) {
+		return ec;
+	}
+
+	epollfd_ctx_fill_pollfds(epollfd, kq, epollfd->pfds);
+
+	int n = real_poll(epollfd->pfds, /**/
+	    (nfds_t)(1 + epollfd->poll_fds_size), 0);
+	if (n < 0) {
+		return errno;
+	}
+	if (n == 0 && epollfd->nr_deferred_changes == 0) {
+		*actual_cnt = 0;
+		return 0;
+	}
+
+	{
+		RegisteredFDsNodeCold *poll_cold, *tmp_poll_cold;
+		size_t i = 1;
+		TAILQ_FOREACH_SAFE (poll_cold, &epollfd->poll_fds,
+		    pollfd_list_entry, tmp_poll_cold) {
+			RegisteredFDsNode *poll_node = poll_cold->node;
+			struct pollfd *pfd = &epollfd->pfds[i++];
+
+			if (pfd->revents & POLLNVAL) {
+				epollfd_ctx_remove_node(epollfd, kq, poll_node);
+			} else if (pfd->revents) {
+				registered_fds_node_trigger_self(poll_node, kq);
+			}
+		}
+	}
+
+	/*
+	 * Each registered fd can produce a maximum of 3 kevents. If
+	 * the provided space in 'ev' is large enough to hold results
+	 * for all registered fds, provide enough space for the kevent
+	 * call as well. Add some wiggle room for the 'poll only fd'
+	 * notification mechanism.
+	 */
+	if ((size_t)cnt >= epollfd->registered_fds_size) {
+		if (__builtin_add_overflow(cnt, 1, &cnt)) {
+			return ENOMEM;
 		}
+		if (__builtin_mul_overflow(cnt, 3, &cnt)) {
+			return ENOMEM;
+		}
+	}
+
+	/*
+	 * Deferred changes are submitted with the same kevent() call. Their
+	 * receipts take up one slot each.
+	 */
+	int nchanges = epollfd->nr_deferred_changes;
+	if (cnt > INT_MAX - nchanges) {
+		return ENOMEM;
+	}
+
+	ec = epollfd_ctx_make_kevs_space(epollfd,
+	    (size_t)cnt + (size_t)nchanges);
+	if (ec != 0) {
+		return ec;
+	}
+
+again:;
+
+	struct kevent *kevs = epollfd->kevs;
+	assert(kevs != NULL);
+
+	if (nchanges) {
+		memcpy(kevs, epollfd->deferred_changes,
+		    (size_t)nchanges * sizeof(struct kevent));
+		epollfd->nr_deferred_changes = 0;
 	}
 
-	if (n && j == 0) {
+	n = kevent(kq, kevs, nchanges, kevs, nchanges + cnt,
+	    &(struct timespec) { 0, 0 });
+	if (n < 0) {
+		ec = errno;
+		epollfd_ctx__reap_removed_nodes(epollfd);
+		return ec;
+	}
+
+	int j = epollfd_ctx__feed_kevents(epollfd, kq, kevs, n,
+	    nchanges + cnt, ev);
+
+	epollfd_ctx__reap_removed_nodes(epollfd);
+
+	if (n > nchanges && j == 0) {
+		nchanges = 0;
 		goto again;
 	}
 
 	*actual_cnt = j;
 	return 0;
 }
+
+errno_t
+epollfd_ctx_begin_kevent_wait(EpollFDCtx *epollfd, int cnt, KeventWait *wait)
+{
+	assert(cnt >= 1);
+
+	/*
+	 * Never ask for more kevents than there is space in 'ev'. Nodes
+	 * may be added while blocking, so we cannot rely on
+	 * 'registered_fds_size' here. Deferred changes are submitted with
+	 * the same kevent() call and need one slot each for their receipts.
+	 */
+	int nchanges = epollfd->nr_deferred_changes;
+	if (cnt > INT_MAX - nchanges) {
+		return ENOMEM;
+	}
+	int length = cnt + nchanges;
+
+	wait->buf = NULL;
+
+	if ((size_t)length <= KEVENT_WAIT_BUF_LENGTH) {
+		wait->kevs = wait->kevs_buf;
+	} else {
+		KeventWaitBuf **bufp = &epollfd->kevent_wait_bufs;
+		while (*bufp && (*bufp)->length < (size_t)length) {
+			bufp = &(*bufp)->next;
+		}
+
+		if (*bufp) {
+			wait->buf = *bufp;
+			*bufp = wait->buf->next;
+		} else {
+			size_t size;
+			if (__builtin_mul_overflow((size_t)length,
+				sizeof(struct kevent), &size) ||
+			    __builtin_add_overflow(size, sizeof(KeventWaitBuf),
+				&size)) {
+				return ENOMEM;
+			}
+
+			if ((wait->buf = malloc(size)) == NULL) {
+				return errno;
+			}
+			wait->buf->length = (size_t)length;
+		}
+
+		wait->kevs = wait->buf->kevs;
+	}
+
+	if (nchanges) {
+		memcpy(wait->kevs, epollfd->deferred_changes,
+		    (size_t)nchanges * sizeof(struct kevent));
+		epollfd->nr_deferred_changes = 0;
+	}
+
+	wait->nchanges = nchanges;
+	wait->length = length;
+
+	++epollfd->nr_kevent_waiters;
+	return 0;
+}
+
+void
+epollfd_ctx_end_kevent_wait(EpollFDCtx *epollfd, int kq, KeventWait *wait,
+    int n, struct epoll_event *ev, int *actual_cnt)
+{
+	*actual_cnt = epollfd_ctx__feed_kevents(epollfd, kq, wait->kevs, n,
+	    wait->length, ev);
+
+	if (wait->buf) {
+		wait->buf->next = epollfd->kevent_wait_bufs;
+		epollfd->kevent_wait_bufs = wait->buf;
+	}
+
+	assert(epollfd->nr_kevent_waiters > 0);
+	--epollfd->nr_kevent_waiters;
+
+	epollfd_ctx__reap_removed_nodes(epollfd);
+}
@@ -3,9 +3,10 @@
 
 #include <sys/epoll.h>
 
+#include <sys/event.h>
 #include <sys/queue.h>
-#include <sys/tree.h>
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,8 +16,12 @@
 
 #include "pollable_desc.h"
 
+#define EPOLLFD_CTX_FLAG_DEFER_CTL (1 << 0)
+
 struct registered_fds_node_;
 typedef struct registered_fds_node_ RegisteredFDsNode;
+struct registered_fds_chunk_;
+typedef struct registered_fds_chunk_ RegisteredFDsChunk;
 
 typedef enum {
 	EOF_STATE_READ_EOF = 0x01,
@@ -31,24 +36,64 @@ typedef enum {
 	NODE_TYPE_POLL = 5,
 } NodeType;
 
-struct registered_fds_node_ {
-	RB_ENTRY(registered_fds_node_) entry;
-	TAILQ_ENTRY(registered_fds_node_) pollfd_list_entry;
+struct epollfd_ctx_;
+struct exclusive_group_;
 
+typedef struct registered_fds_node_cold_ {
+	TAILQ_ENTRY(registered_fds_node_cold_) pollfd_list_entry;
+	RegisteredFDsNode *node;
+	int self_pipe[2];
+
+	/* Membership in the group of EPOLLEXCLUSIVE registrations of the
+	 * same socket across epoll instances. */
+	TAILQ_ENTRY(registered_fds_node_cold_) exclusive_group_entry;
+	TAILQ_ENTRY(registered_fds_node_cold_) exclusive_nodes_entry;
+	struct exclusive_group_ *exclusive_group;
+	struct epollfd_ctx_ *epollfd;
+	int kq;
+	bool exclusive_recheck;
+} RegisteredFDsNodeCold;
+
+/*
+ * Everything touched when feeding events is kept within 64 bytes. State
+ * only needed by poll-only fds and the self-pipe fallback lives in a
+ * separately allocated RegisteredFDsNodeCold.
+ */
+struct registered_fds_node_ {
 	int fd;
-	epoll_data_t data;
+	uint16_t events;
+	uint8_t node_type; /* NodeType */
+	uint8_t eof_state; /* EOFState */
+	uint32_t revents;
+
+	bool is_registered : 1;
+
+	bool has_evfilt_read : 1;
+	bool has_evfilt_write : 1;
+	bool has_evfilt_except : 1;
 
-	bool is_registered;
+	/* Whether the registered filters use EV_CLEAR. */
+	bool is_evfilt_read_clear : 1;
+	bool is_evfilt_write_clear : 1;
+	bool is_evfilt_except_clear : 1;
 
-	bool has_evfilt_read;
-	bool has_evfilt_write;
-	bool has_evfilt_except;
+	bool got_evfilt_read : 1;
+	bool got_evfilt_write : 1;
+	bool got_evfilt_except : 1;
 
-	bool got_evfilt_read;
-	bool got_evfilt_write;
-	bool got_evfilt_except;
+	bool pollpri_active : 1;
+
+	bool is_edge_triggered : 1;
+	bool is_oneshot : 1;
+	bool is_exclusive : 1;
+	/* Exclusive nodes only have filters registered while armed. */
+	bool is_exclusive_armed : 1;
+
+	bool is_on_pollfd_list : 1;
+	bool is_ctl_pending : 1;
+
+	epoll_data_t data;
 
-	NodeType node_type;
 	union {
 		struct {
 			bool readable;
@@ -58,28 +103,61 @@ struct registered_fds_node_ {
 			PollableDesc pollable_desc;
 		} kqueue;
 	} node_data;
-	int eof_state;
-	bool pollpri_active;
 
-	uint16_t events;
-	uint32_t revents;
+	RegisteredFDsNodeCold *cold;
+	RegisteredFDsChunk *chunk;
+	SLIST_ENTRY(registered_fds_node_) free_list_entry;
+};
 
-	bool is_edge_triggered;
-	bool is_oneshot;
+typedef TAILQ_HEAD(pollfds_list_, registered_fds_node_cold_) PollFDList;
+typedef TAILQ_HEAD(exclusive_nodes_list_, registered_fds_node_cold_)
+    ExclusiveNodesList;
+typedef SLIST_HEAD(registered_fds_node_list_, registered_fds_node_)
+    RegisteredFDsNodeList;
 
-	bool is_on_pollfd_list;
-	int self_pipe[2];
+#define REGISTERED_FDS_CHUNK_NODES 64
+
+struct registered_fds_chunk_ {
+	LIST_ENTRY(registered_fds_chunk_) entry;
+	RegisteredFDsNodeList free_nodes;
+	unsigned int nr_used;
+	unsigned int nr_initialized;
+	_Alignas(64) RegisteredFDsNode nodes[REGISTERED_FDS_CHUNK_NODES];
 };
 
-typedef TAILQ_HEAD(pollfds_list_, registered_fds_node_) PollFDList;
-typedef RB_HEAD(registered_fds_set_, registered_fds_node_) RegisteredFDsSet;
+/*
+ * Registered nodes are indexed by fd in a three level radix tree. Only the
+ * root is grown, so a single high fd doesn't need a huge table.
+ */
+#define REGISTERED_FDS_LEAF_BITS 6
+#define REGISTERED_FDS_INNER_BITS 8
+#define REGISTERED_FDS_ROOT_SHIFT \
+	(REGISTERED_FDS_LEAF_BITS + REGISTERED_FDS_INNER_BITS)
 
 typedef struct {
+	RegisteredFDsNode *nodes[1 << REGISTERED_FDS_LEAF_BITS];
+} RegisteredFDsLeaf;
+
+typedef struct {
+	RegisteredFDsLeaf *leaves[1 << REGISTERED_FDS_INNER_BITS];
+} RegisteredFDsInner;
+
+typedef struct {
+	/* Chunks that have at least one unused node. */
+	LIST_HEAD(registered_fds_chunks_, registered_fds_chunk_) chunks;
+	/* One completely empty chunk is kept around. */
+	RegisteredFDsChunk *spare_chunk;
+} RegisteredFDsSlab;
+
+typedef struct epollfd_ctx_ {
 	PollFDList poll_fds;
 	size_t poll_fds_size;
 
-	RegisteredFDsSet registered_fds;
+	/* Root of the radix tree indexed by fd. */
+	RegisteredFDsInner **registered_fds;
+	unsigned int registered_fds_length;
 	size_t registered_fds_size;
+	RegisteredFDsSlab registered_fds_slab;
 
 	struct kevent *kevs;
 	size_t kevs_length;
@@ -91,20 +169,84 @@ typedef struct {
 	pthread_cond_t nr_polling_threads_cond;
 	unsigned long nr_polling_threads;
 
+	/* Threads blocking in kevent() without holding the lock. Nodes
+	 * removed while there are any are kept on 'removed_nodes'. */
+	unsigned long nr_kevent_waiters;
+	RegisteredFDsNodeList removed_nodes;
+
+	/* Event lists of those threads that are too large for their stack,
+	 * kept for reuse. */
+	struct kevent_wait_buf_ *kevent_wait_bufs;
+
+	int flags;
+
+	/* epoll_wait() deadlines are delayed to multiples of this, if != 0.
+	 * Read without holding the lock. */
+	atomic_long timer_slack_nanos;
+
+	/* Nodes that are members of an exclusive group. Other members use
+	 * our own duplicate of the kqueue. */
+	ExclusiveNodesList exclusive_nodes;
+	int exclusive_kq;
+
+	/* Changes queued by EPOLL_CTL_MOD/EPOLL_CTL_DEL if
+	 * EPOLLFD_CTX_FLAG_DEFER_CTL is set. They are applied by the next
+	 * kevent() call on the kqueue. */
+	struct kevent *deferred_changes;
+	int nr_deferred_changes;
+
 	int self_pipe[2];
+
+	/* Used for completion of events and other short-lived queries.
+	 * Must be left empty after use. */
+	int scratch_kq;
 } EpollFDCtx;
 
-errno_t epollfd_ctx_init(EpollFDCtx *epollfd);
+#define KEVENT_WAIT_BUF_LENGTH 32
+
+typedef struct kevent_wait_buf_ {
+	struct kevent_wait_buf_ *next;
+	size_t length;
+	struct kevent kevs[];
+} KeventWaitBuf;
+
+/* State of a thread blocking in kevent() without holding the lock. */
+typedef struct {
+	struct kevent *kevs;
+	int nchanges;
+	int length;
+	KeventWaitBuf *buf;
+	struct kevent kevs_buf[KEVENT_WAIT_BUF_LENGTH];
+} KeventWait;
+
+errno_t epollfd_ctx_init(EpollFDCtx *epollfd, int flags);
 errno_t epollfd_ctx_terminate(EpollFDCtx *epollfd);
 
 void epollfd_ctx_fill_pollfds(EpollFDCtx *epollfd, int kq, struct pollfd *pfds);
+void epollfd_ctx_poll(EpollFDCtx *epollfd, int kq);
+// Calls 'fun' for registered fds that are descriptors of this library.
+void epollfd_ctx_for_each_nested_desc(EpollFDCtx *epollfd,
+    void (*fun)(PollableDesc pollable_desc, void *arg), void *arg);
 
 // Called on fd2 close().
 void epollfd_ctx_remove_fd(EpollFDCtx *epollfd, int kq, int fd2);
 
 errno_t epollfd_ctx_ctl(EpollFDCtx *epollfd, int kq, /**/
     int op, int fd2, PollableDesc pollable_desc, struct epoll_event *ev);
+errno_t epollfd_ctx_ctl_batch(EpollFDCtx *epollfd, int kq, /**/
+    struct epoll_shim_ctl_op *ops, PollableDesc const *pollable_descs, int n,
+    int *nr_failed);
+// Called before blocking in epoll_wait(), after counting as polling thread.
+void epollfd_ctx_claim_exclusive_nodes(EpollFDCtx *epollfd, int kq);
+// Called after a thread stopped polling.
+void epollfd_ctx_release_exclusive_nodes(EpollFDCtx *epollfd, int kq);
+
 errno_t epollfd_ctx_wait(EpollFDCtx *epollfd, int kq, /**/
     struct epoll_event *ev, int cnt, int *actual_cnt);
 
+errno_t epollfd_ctx_begin_kevent_wait(EpollFDCtx *epollfd, int cnt,
+    KeventWait *wait);
+void epollfd_ctx_end_kevent_wait(EpollFDCtx *epollfd, int kq,
+    KeventWait *wait, int n, struct epoll_event *ev, int *actual_cnt);
+
 #endif
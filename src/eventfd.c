@@ -19,6 +19,18 @@
 #include "epoll_shim_ctx.h"
 #include "epoll_shim_export.h"
 
+static errno_t
+eventfd_update_event(FileDescription *desc, int kq)
+{
+	errno_t ec;
+
+	(void)pthread_mutex_lock(&desc->mutex);
+	ec = eventfd_ctx_update_event(&desc->ctx.eventfd, kq);
+	(void)pthread_mutex_unlock(&desc->mutex);
+
+	return ec;
+}
+
 static errno_t
 eventfd_ctx_read_or_block(FileDescription *desc, int kq, uint64_t *value)
 {
@@ -26,21 +38,38 @@ eventfd_ctx_read_or_block(FileDescription *desc, int kq, uint64_t *value)
 	EventFDCtx *eventfd_ctx = &desc->ctx.eventfd;
 
 	for (;;) {
+		bool needs_update;
+		ec = eventfd_ctx_read(eventfd_ctx, value, &needs_update);
+		if (ec == 0) {
+			if (needs_update) {
+				(void)eventfd_update_event(desc, kq);
+			}
+			return 0;
+		}
+
+		if (ec != EAGAIN) {
+			return ec;
+		}
+
 		(void)pthread_mutex_lock(&desc->mutex);
-		ec = eventfd_ctx_read(eventfd_ctx, kq, value);
 		bool nonblock = (desc->flags & O_NONBLOCK) != 0;
+		if (!nonblock) {
+			ec = eventfd_ctx_wait(eventfd_ctx, &desc->mutex);
+		}
 		(void)pthread_mutex_unlock(&desc->mutex);
 
-		if (nonblock || ec != EAGAIN) {
-			return ec;
+		if (nonblock) {
+			return EAGAIN;
 		}
 
-		struct pollfd pfd = {
-			.fd = kq,
-			.events = POLLIN,
-		};
-		if (real_poll(&pfd, 1, -1) < 0) {
-			return errno;
+		if (ec == EAGAIN) {
+			struct pollfd pfd = {
+				.fd = kq,
+				.events = POLLIN,
+			};
+			if (real_poll(&pfd, 1, -1) < 0) {
+				return errno;
+			}
 		}
 	}
 }
@@ -78,10 +107,13 @@ eventfd_helper_write(FileDescription *desc, int kq, /**/
 	uint64_t value;
 	memcpy(&value, buf, sizeof(uint64_t));
 
-	(void)pthread_mutex_lock(&desc->mutex);
-	ec = eventfd_ctx_write(&desc->ctx.eventfd, kq, value);
-	(void)pthread_mutex_unlock(&desc->mutex);
-	if (ec != 0) {
+	bool needs_update;
+	if ((ec = eventfd_ctx_write(&desc->ctx.eventfd, value,
+		 &needs_update)) != 0) {
+		return ec;
+	}
+	if (needs_update &&
+	    (ec = eventfd_update_event(desc, kq)) != 0) {
 		return ec;
 	}
 
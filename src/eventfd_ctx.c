@@ -9,8 +9,11 @@
 #include <errno.h>
 
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "timespec_util.h"
+
 _Static_assert(sizeof(unsigned int) < sizeof(uint64_t), "");
 
 errno_t
@@ -22,12 +25,29 @@ eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter, int flags)
 
 	*eventfd = (EventFDCtx) {
 		.flags_ = flags,
-		.counter_ = counter,
 	};
+	atomic_init(&eventfd->counter_, counter);
 
 	struct kevent kevs[2];
 	int kevs_length = 0;
 
+	/* macOS has no pthread_condattr_setclock(), but a relative wait. */
+#ifdef __APPLE__
+	ec = pthread_cond_init(&eventfd->blocked_readers_cond_, NULL);
+#else
+	pthread_condattr_t attr;
+	if ((ec = pthread_condattr_init(&attr)) != 0) {
+		return ec;
+	}
+	if ((ec = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) == 0) {
+		ec = pthread_cond_init(&eventfd->blocked_readers_cond_, &attr);
+	}
+	(void)pthread_condattr_destroy(&attr);
+#endif
+	if (ec != 0) {
+		return ec;
+	}
+
 	if ((ec = kqueue_event_init(&eventfd->kqueue_event_, /**/
 		 kevs, &kevs_length, counter > 0)) != 0) {
 		goto out2;
@@ -43,6 +63,7 @@ eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter, int flags)
 out:
 	(void)kqueue_event_terminate(&eventfd->kqueue_event_);
 out2:
+	(void)pthread_cond_destroy(&eventfd->blocked_readers_cond_);
 	return ec;
 }
 
@@ -55,61 +76,134 @@ eventfd_ctx_terminate(EventFDCtx *eventfd)
 	ec_local = kqueue_event_terminate(&eventfd->kqueue_event_);
 	ec = ec != 0 ? ec : ec_local;
 
+	ec_local = pthread_cond_destroy(&eventfd->blocked_readers_cond_);
+	ec = ec != 0 ? ec : ec_local;
+
 	return (ec);
 }
 
+/*
+ * The counter is changed without a lock. Only callers that see it
+ * change between zero and non-zero have to call
+ * eventfd_ctx_update_event() afterwards, which makes the kqueue event
+ * match the current counter value.
+ */
+
 errno_t
-eventfd_ctx_write(EventFDCtx *eventfd, int kq, uint64_t value)
+eventfd_ctx_write(EventFDCtx *eventfd, uint64_t value, bool *needs_update)
 {
-	errno_t ec;
-
 	if (value == UINT64_MAX) {
 		return EINVAL;
 	}
 
-	uint_least64_t current_value = eventfd->counter_;
+	uint_least64_t current_value = atomic_load_explicit(&eventfd->counter_,
+	    memory_order_relaxed);
 
 	uint_least64_t new_value;
-	if (__builtin_add_overflow(current_value, value, &new_value) ||
-	    new_value > UINT64_MAX - 1) {
-		return EAGAIN;
-	}
+	do {
+		if (__builtin_add_overflow(current_value, value, &new_value) ||
+		    new_value > UINT64_MAX - 1) {
+			return EAGAIN;
+		}
+	} while (!atomic_compare_exchange_weak(&eventfd->counter_,
+	    &current_value, new_value));
+
+	*needs_update = current_value == 0 && new_value != 0;
+	return 0;
+}
 
-	eventfd->counter_ = new_value;
+errno_t
+eventfd_ctx_read(EventFDCtx *eventfd, uint64_t *value, bool *needs_update)
+{
+	uint_least64_t current_value = atomic_load_explicit(&eventfd->counter_,
+	    memory_order_relaxed);
 
-	ec = kqueue_event_trigger(&eventfd->kqueue_event_, kq);
-	if (ec != 0) {
-		return ec;
+	uint_least64_t new_value;
+	do {
+		if (current_value == 0) {
+			return EAGAIN;
+		}
+
+		new_value =					     /**/
+		    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? /**/
+		    current_value - 1 :
+		    0;
+	} while (!atomic_compare_exchange_weak(&eventfd->counter_,
+	    &current_value, new_value));
+
+	*needs_update = new_value == 0;
+	*value =					     /**/
+	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? /**/
+	    1 :
+	    current_value;
+	return 0;
+}
+
+errno_t
+eventfd_ctx_update_event(EventFDCtx *eventfd, int kq)
+{
+	if (atomic_load(&eventfd->counter_) != 0) {
+		if (eventfd->nr_blocked_readers_ != 0) {
+			(void)pthread_cond_broadcast(
+			    &eventfd->blocked_readers_cond_);
+		}
+		return kqueue_event_trigger(&eventfd->kqueue_event_, kq);
+	}
+
+	if (kqueue_event_is_triggered(&eventfd->kqueue_event_)) {
+		(void)kqueue_event_clear(&eventfd->kqueue_event_, kq);
 	}
 
 	return 0;
 }
 
+/*
+ * Blocking readers wait here for up to EVENTFD_CTX_PARK_NANOS before
+ * polling the kqueue, so that a writer can hand over to them without a
+ * round trip through the kernel. Every write that makes the counter
+ * non-zero calls eventfd_ctx_update_event(), which wakes them up.
+ *
+ * The wait is kept short because it is not interrupted by signals. Only
+ * the poll() that follows is. Cancellation is disabled, as it would
+ * leave the mutex locked. Returns EAGAIN if the caller should go on to
+ * poll the kqueue without holding the mutex.
+ */
 errno_t
-eventfd_ctx_read(EventFDCtx *eventfd, int kq, uint64_t *value)
+eventfd_ctx_wait(EventFDCtx *eventfd, pthread_mutex_t *mutex)
 {
-	uint_least64_t current_value;
+	errno_t ec;
 
-	current_value = eventfd->counter_;
-	if (current_value == 0) {
+	if (atomic_load(&eventfd->counter_) != 0) {
+		return 0;
+	}
+
+	struct timespec timeout = { 0, EVENTFD_CTX_PARK_NANOS };
+#ifndef __APPLE__
+	struct timespec deadline;
+	if (clock_gettime(CLOCK_MONOTONIC, &deadline) < 0 ||
+	    !timespecadd_safe(&deadline, &timeout, &deadline)) {
 		return EAGAIN;
 	}
+#endif
 
-	uint_least64_t new_value =			     /**/
-	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? /**/
-	    current_value - 1 :
-	    0;
+	int cs;
+	(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
 
-	if (new_value == 0 &&
-	    kqueue_event_is_triggered(&eventfd->kqueue_event_)) {
-		kqueue_event_clear(&eventfd->kqueue_event_, kq);
-	}
+	++eventfd->nr_blocked_readers_;
+#ifdef __APPLE__
+	ec = pthread_cond_timedwait_relative_np(&eventfd->blocked_readers_cond_,
+	    mutex, &timeout);
+#else
+	ec = pthread_cond_timedwait(&eventfd->blocked_readers_cond_, mutex,
+	    &deadline);
+#endif
+	--eventfd->nr_blocked_readers_;
 
-	eventfd->counter_ = new_value;
+	(void)pthread_setcancelstate(cs, NULL);
+
+	if (ec == ETIMEDOUT && atomic_load(&eventfd->counter_) == 0) {
+		return EAGAIN;
+	}
 
-	*value =					     /**/
-	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? /**/
-	    1 :
-	    current_value;
 	return 0;
 }
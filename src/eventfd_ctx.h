@@ -1,6 +1,7 @@
 #ifndef EVENTFD_CTX_H_
 #define EVENTFD_CTX_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,18 +12,30 @@
 
 #define EVENTFD_CTX_FLAG_SEMAPHORE (1 << 0)
 
+/* How long blocking readers wait for a writer before polling. */
+#define EVENTFD_CTX_PARK_NANOS 100000
+
 typedef struct {
 	int flags_;
 
+	/* Those are protected by the lock the caller passes to
+	 * eventfd_ctx_wait() and holds around eventfd_ctx_update_event(). */
 	KQueueEvent kqueue_event_;
-	uint_least64_t counter_;
+	pthread_cond_t blocked_readers_cond_;
+	unsigned int nr_blocked_readers_;
+
+	atomic_uint_least64_t counter_;
 } EventFDCtx;
 
 errno_t eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter,
     int flags);
 errno_t eventfd_ctx_terminate(EventFDCtx *eventfd);
 
-errno_t eventfd_ctx_write(EventFDCtx *eventfd, int kq, uint64_t value);
-errno_t eventfd_ctx_read(EventFDCtx *eventfd, int kq, uint64_t *value);
+errno_t eventfd_ctx_write(EventFDCtx *eventfd, uint64_t value,
+    bool *needs_update);
+errno_t eventfd_ctx_read(EventFDCtx *eventfd, uint64_t *value,
+    bool *needs_update);
+errno_t eventfd_ctx_update_event(EventFDCtx *eventfd, int kq);
+errno_t eventfd_ctx_wait(EventFDCtx *eventfd, pthread_mutex_t *mutex);
 
 #endif
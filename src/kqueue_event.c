@@ -3,6 +3,7 @@
 #include <sys/param.h>
 
 #include <assert.h>
+#include <stdint.h>
 
 #include <fcntl.h>
 #include <time.h>
@@ -102,7 +103,11 @@ kqueue_event_trigger(KQueueEvent *kqueue_event, int kq)
 	return 0;
 }
 
-void
+/*
+ * Drains all events from 'kq'. Returns how many of them were not the
+ * kqueue event itself.
+ */
+int
 kqueue_event_clear(KQueueEvent *kqueue_event, int kq)
 {
 #ifndef EVFILT_USER
@@ -113,10 +118,27 @@ kqueue_event_clear(KQueueEvent *kqueue_event, int kq)
 
 	struct kevent kevs[32];
 	int n;
+	int nr_others = 0;
 
 	while ((n = kevent(kq, NULL, 0, kevs, 32,
 		    &(struct timespec) { 0, 0 })) > 0) {
+		for (int i = 0; i < n; ++i) {
+#ifdef EVFILT_USER
+			if (kevs[i].filter == EVFILT_USER &&
+			    kevs[i].ident == 0) {
+				continue;
+			}
+#else
+			if (kevs[i].filter == EVFILT_READ &&
+			    kevs[i].ident ==
+				(uintptr_t)kqueue_event->self_pipe_[0]) {
+				continue;
+			}
+#endif
+			++nr_others;
+		}
 	}
 
 	kqueue_event->is_triggered_ = false;
+	return nr_others;
 }
@@ -10,6 +10,22 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+#ifdef EPOLL_SHIM_BIG_READER_RWLOCK
+#define RWLOCK_NR_READER_SLOTS 64
+
+typedef struct {
+	_Alignas(64) atomic_int_fast32_t nr_readers;
+} RWLockReaderSlot;
+
+typedef struct {
+	RWLockReaderSlot reader_slots[RWLOCK_NR_READER_SLOTS];
+	atomic_bool writer_active;
+	pthread_mutex_t writer_mutex;
+	pthread_mutex_t mutex;
+	pthread_cond_t reader_cond;
+	pthread_cond_t writer_cond;
+} RWLock;
+#else
 typedef struct {
 	pthread_mutex_t mutex;
 	sem_t writer_wait;
@@ -17,6 +33,7 @@ typedef struct {
 	atomic_int_fast32_t num_pending;
 	atomic_int_fast32_t readers_departing;
 } RWLock;
+#endif
 
 errno_t rwlock_init(RWLock *rwlock);
 void rwlock_terminate(RWLock *rwlock);
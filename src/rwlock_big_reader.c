@@ -0,0 +1,158 @@
+#include "rwlock.h"
+
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * Big reader lock: every thread counts itself as a reader in one of
+ * RWLOCK_NR_READER_SLOTS cache lines, so that readers on different CPUs
+ * don't share a counter. A writer announces itself in 'writer_active' and
+ * then waits until all slots are empty. Readers that see an active writer
+ * back off and wait for it to finish.
+ */
+
+static atomic_uint next_reader_slot;
+static _Thread_local unsigned int reader_slot = UINT_MAX;
+
+static RWLockReaderSlot *
+rwlock_reader_slot(RWLock *rwlock)
+{
+	if (reader_slot == UINT_MAX) {
+		reader_slot = atomic_fetch_add_explicit(&next_reader_slot, 1,
+				  memory_order_relaxed) %
+		    RWLOCK_NR_READER_SLOTS;
+	}
+
+	return &rwlock->reader_slots[reader_slot];
+}
+
+static void
+cond_wait_nointr(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int cs;
+	(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+	(void)pthread_cond_wait(cond, mutex);
+	(void)pthread_setcancelstate(cs, NULL);
+}
+
+errno_t
+rwlock_init(RWLock *rwlock)
+{
+	errno_t ec;
+
+	*rwlock = (RWLock) {};
+
+	if ((ec = pthread_mutex_init(&rwlock->writer_mutex, NULL)) != 0) {
+		goto out_writer_mutex;
+	}
+
+	if ((ec = pthread_mutex_init(&rwlock->mutex, NULL)) != 0) {
+		goto out_mutex;
+	}
+
+	if ((ec = pthread_cond_init(&rwlock->reader_cond, NULL)) != 0) {
+		goto out_reader_cond;
+	}
+
+	if ((ec = pthread_cond_init(&rwlock->writer_cond, NULL)) != 0) {
+		goto out_writer_cond;
+	}
+
+	return 0;
+
+	(void)pthread_cond_destroy(&rwlock->writer_cond);
+out_writer_cond:
+	(void)pthread_cond_destroy(&rwlock->reader_cond);
+out_reader_cond:
+	(void)pthread_mutex_destroy(&rwlock->mutex);
+out_mutex:
+	(void)pthread_mutex_destroy(&rwlock->writer_mutex);
+out_writer_mutex:
+	return ec;
+}
+
+void
+rwlock_terminate(RWLock *rwlock)
+{
+	(void)pthread_cond_destroy(&rwlock->writer_cond);
+	(void)pthread_cond_destroy(&rwlock->reader_cond);
+	(void)pthread_mutex_destroy(&rwlock->mutex);
+	(void)pthread_mutex_destroy(&rwlock->writer_mutex);
+}
+
+static void
+rwlock_leave_slot(RWLock *rwlock, RWLockReaderSlot *slot)
+{
+	if (atomic_fetch_sub(&slot->nr_readers, 1) - 1 == 0 &&
+	    atomic_load(&rwlock->writer_active)) {
+		(void)pthread_mutex_lock(&rwlock->mutex);
+		(void)pthread_cond_broadcast(&rwlock->writer_cond);
+		(void)pthread_mutex_unlock(&rwlock->mutex);
+	}
+}
+
+void
+rwlock_lock_read(RWLock *rwlock)
+{
+	RWLockReaderSlot *slot = rwlock_reader_slot(rwlock);
+
+	for (;;) {
+		atomic_fetch_add(&slot->nr_readers, 1);
+		if (!atomic_load(&rwlock->writer_active)) {
+			return;
+		}
+
+		rwlock_leave_slot(rwlock, slot);
+
+		(void)pthread_mutex_lock(&rwlock->mutex);
+		while (atomic_load(&rwlock->writer_active)) {
+			cond_wait_nointr(&rwlock->reader_cond, &rwlock->mutex);
+		}
+		(void)pthread_mutex_unlock(&rwlock->mutex);
+	}
+}
+
+void
+rwlock_unlock_read(RWLock *rwlock)
+{
+	rwlock_leave_slot(rwlock, rwlock_reader_slot(rwlock));
+}
+
+void
+rwlock_lock_write(RWLock *rwlock)
+{
+	(void)pthread_mutex_lock(&rwlock->writer_mutex);
+	atomic_store(&rwlock->writer_active, true);
+
+	for (int i = 0; i < RWLOCK_NR_READER_SLOTS; ++i) {
+		RWLockReaderSlot *slot = &rwlock->reader_slots[i];
+		if (atomic_load(&slot->nr_readers) == 0) {
+			continue;
+		}
+
+		(void)pthread_mutex_lock(&rwlock->mutex);
+		while (atomic_load(&slot->nr_readers) != 0) {
+			cond_wait_nointr(&rwlock->writer_cond, &rwlock->mutex);
+		}
+		(void)pthread_mutex_unlock(&rwlock->mutex);
+	}
+}
+
+void
+rwlock_unlock_write(RWLock *rwlock)
+{
+	(void)pthread_mutex_lock(&rwlock->mutex);
+	atomic_store(&rwlock->writer_active, false);
+	(void)pthread_cond_broadcast(&rwlock->reader_cond);
+	(void)pthread_mutex_unlock(&rwlock->mutex);
+
+	(void)pthread_mutex_unlock(&rwlock->writer_mutex);
+}
+
+void
+rwlock_downgrade(RWLock *rwlock)
+{
+	/* No other reader can get in before the writer is gone. */
+	atomic_fetch_add(&rwlock_reader_slot(rwlock)->nr_readers, 1);
+	rwlock_unlock_write(rwlock);
+}
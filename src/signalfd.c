@@ -23,17 +23,17 @@
 #include "errno_return.h"
 
 static errno_t
-signalfd_ctx_read_or_block(FileDescription *desc, int kq,
-    SignalFDCtxSiginfo *siginfo, bool force_nonblock)
+signalfd_ctx_read_or_block(FileDescription *desc, int kq, void *siginfos,
+    size_t nr_siginfos, size_t *nr_read)
 {
 	errno_t ec;
 	SignalFDCtx *signalfd_ctx = &desc->ctx.signalfd;
 
 	for (;;) {
 		(void)pthread_mutex_lock(&desc->mutex);
-		ec = signalfd_ctx_read(signalfd_ctx, kq, siginfo);
-		bool nonblock = force_nonblock ||
-		    (desc->flags & O_NONBLOCK) != 0;
+		ec = signalfd_ctx_read(signalfd_ctx, kq, siginfos, nr_siginfos,
+		    nr_read);
+		bool nonblock = (desc->flags & O_NONBLOCK) != 0;
 		(void)pthread_mutex_unlock(&desc->mutex);
 		if (nonblock || (ec != EAGAIN && ec != EWOULDBLOCK)) {
 			return ec;
@@ -55,40 +55,23 @@ signalfd_read(FileDescription *desc, int kq, void *buf, size_t nbytes,
 {
 	errno_t ec;
 
-	if (nbytes < sizeof(struct signalfd_siginfo)) {
-		return EINVAL;
-	}
-
-	bool force_nonblock = false;
-	size_t bytes_transferred_local = 0;
-
-	while (nbytes >= sizeof(struct signalfd_siginfo)) {
-		_Static_assert(sizeof(struct signalfd_siginfo) ==
-			sizeof(SignalFDCtxSiginfo),
-		    "");
-
-		SignalFDCtxSiginfo siginfo;
-		memset(&siginfo, 0, sizeof(siginfo));
-
-		if ((ec = signalfd_ctx_read_or_block(desc, kq, &siginfo,
-			 force_nonblock)) != 0) {
-			break;
-		}
-
-		memcpy(buf, &siginfo, sizeof(siginfo));
-		bytes_transferred_local += sizeof(siginfo);
+	_Static_assert(sizeof(struct signalfd_siginfo) ==
+		sizeof(SignalFDCtxSiginfo),
+	    "");
 
-		force_nonblock = true;
-		nbytes -= sizeof(siginfo);
-		buf = ((unsigned char *)buf) + sizeof(siginfo);
+	size_t nr_siginfos = nbytes / sizeof(struct signalfd_siginfo);
+	if (nr_siginfos == 0) {
+		return EINVAL;
 	}
 
-	if (bytes_transferred_local > 0) {
-		ec = 0;
+	size_t nr_read;
+	if ((ec = signalfd_ctx_read_or_block(desc, kq, buf, nr_siginfos,
+		 &nr_read)) != 0) {
+		return ec;
 	}
 
-	*bytes_transferred = bytes_transferred_local;
-	return ec;
+	*bytes_transferred = nr_read * sizeof(struct signalfd_siginfo);
+	return 0;
 }
 
 static errno_t
@@ -34,6 +34,7 @@ signalfd_has_pending(SignalFDCtx const *signalfd, bool *has_pending,
 static errno_t
 signalfd_ctx_trigger_manually(SignalFDCtx *signalfd, int kq)
 {
+	signalfd->is_idle = false;
 	return kqueue_event_trigger(&signalfd->kqueue_event, kq);
 }
 
@@ -291,40 +292,75 @@ signalfd_ctx_clear_signal(SignalFDCtx *signalfd, int kq, bool was_triggered)
 		bool has_pending;
 		if (signalfd_has_pending(signalfd, &has_pending, NULL) != 0 ||
 		    has_pending) {
+			signalfd->is_idle = false;
 			return true;
 		}
+	} else if (signalfd->is_idle) {
+		/*
+		 * Any signal delivered since then would have made the kq
+		 * readable and led to a call with 'was_triggered' set.
+		 */
+		return false;
 	}
 
 	/*
 	 * Clear the kq. Signals can arrive here, leading to a race.
 	 */
 
-	kqueue_event_clear(&signalfd->kqueue_event, kq);
+	int nr_signal_events = kqueue_event_clear(&signalfd->kqueue_event, kq);
 
 	/*
 	 * Because of the race, we must recheck and manually trigger if
-	 * necessary.
+	 * necessary. If no EVFILT_SIGNAL event was drained, no signal
+	 * arrived since the check above, and later ones will make the kq
+	 * readable again.
 	 */
-	bool has_pending;
-	if (signalfd_has_pending(signalfd, &has_pending, NULL) != 0 ||
-	    has_pending) {
-		(void)signalfd_ctx_trigger_manually(signalfd, kq);
-		return true;
+	if (!was_triggered || nr_signal_events != 0) {
+		bool has_pending;
+		if (signalfd_has_pending(signalfd, &has_pending, NULL) != 0 ||
+		    has_pending) {
+			(void)signalfd_ctx_trigger_manually(signalfd, kq);
+			return true;
+		}
 	}
+
+	signalfd->is_idle = true;
 	return false;
 }
 
+/*
+ * Dequeues up to 'nr_siginfos' signals into 'siginfos', which does not
+ * need to be aligned. The kq is only cleared and rechecked once, after the
+ * whole batch.
+ */
 errno_t
-signalfd_ctx_read(SignalFDCtx *signalfd, int kq, SignalFDCtxSiginfo *siginfo)
+signalfd_ctx_read(SignalFDCtx *signalfd, int kq, void *siginfos,
+    size_t nr_siginfos, size_t *nr_read)
 {
-	errno_t ec;
+	errno_t ec = 0;
+	size_t i;
+
+	assert(nr_siginfos > 0);
+
+	for (i = 0; i < nr_siginfos; ++i) {
+		SignalFDCtxSiginfo siginfo;
+		memset(&siginfo, 0, sizeof(siginfo));
+
+		if ((ec = signalfd_ctx_read_impl(signalfd, &siginfo)) != 0) {
+			break;
+		}
+
+		memcpy((unsigned char *)siginfos + i * sizeof(siginfo),
+		    &siginfo, sizeof(siginfo));
+	}
 
-	ec = signalfd_ctx_read_impl(signalfd, siginfo);
 	if (ec == 0 || ec == EAGAIN || ec == EWOULDBLOCK) {
+		signalfd->is_idle = false;
 		(void)signalfd_ctx_clear_signal(signalfd, kq, false);
 	}
 
-	return ec;
+	*nr_read = i;
+	return i > 0 ? 0 : ec;
 }
 
 void
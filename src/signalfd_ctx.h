@@ -2,6 +2,7 @@
 #define SIGNALFD_CTX_H_
 
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -12,6 +13,10 @@
 typedef struct {
 	sigset_t sigs;
 	KQueueEvent kqueue_event;
+
+	/* The kq was found empty with no signals pending. It stays like
+	 * this until EVFILT_SIGNAL makes the kq readable again. */
+	bool is_idle;
 } SignalFDCtx;
 
 typedef struct {
@@ -38,8 +43,8 @@ typedef struct {
 errno_t signalfd_ctx_init(SignalFDCtx *signalfd, int kq, sigset_t const *sigs);
 errno_t signalfd_ctx_terminate(SignalFDCtx *signalfd);
 
-errno_t signalfd_ctx_read(SignalFDCtx *signalfd, int kq,
-    SignalFDCtxSiginfo *siginfo);
+errno_t signalfd_ctx_read(SignalFDCtx *signalfd, int kq, void *siginfos,
+    size_t nr_siginfos, size_t *nr_read);
 void signalfd_ctx_poll(SignalFDCtx *signalfd, int kq, uint32_t *revents);
 
 #endif
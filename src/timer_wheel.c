@@ -0,0 +1,471 @@
+#include "timer_wheel.h"
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "timespec_util.h"
+#include "wrap.h"
+
+#define TIMER_WHEEL_TICK_NANOS 1000000
+#define TIMER_WHEEL_TICKS_PER_SEC (1000000000 / TIMER_WHEEL_TICK_NANOS)
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK ((uint64_t)TIMER_WHEEL_SLOTS - 1)
+
+typedef LIST_HEAD(timer_wheel_list_, timer_wheel_entry_) TimerWheelList;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	bool is_running;
+	int kq;
+
+	/* All ticks before this one have been processed. */
+	uint64_t current_tick;
+	/* When the wheel thread will wake up next, UINT64_MAX if never. */
+	uint64_t wakeup_tick;
+
+	size_t nr_entries;
+	/* Slots of level n are 64^n ticks wide. */
+	TimerWheelList slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	/* Entries too far in the future for the highest level. */
+	TimerWheelList overflow;
+} TimerWheel;
+
+static TimerWheel timer_wheel = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int
+timer_wheel_level_shift(int level)
+{
+	return (unsigned int)level * TIMER_WHEEL_SLOT_BITS;
+}
+
+static uint64_t
+timespec_to_tick(struct timespec const *ts, bool round_up)
+{
+	if (ts->tv_sec < 0) {
+		return 0;
+	}
+
+	uint64_t tick;
+	if (__builtin_mul_overflow((uint64_t)ts->tv_sec,
+		TIMER_WHEEL_TICKS_PER_SEC, &tick) ||
+	    __builtin_add_overflow(tick,
+		(uint64_t)ts->tv_nsec / TIMER_WHEEL_TICK_NANOS, &tick)) {
+		return UINT64_MAX;
+	}
+
+	if (round_up && (ts->tv_nsec % TIMER_WHEEL_TICK_NANOS) != 0 &&
+	    tick != UINT64_MAX) {
+		++tick;
+	}
+
+	return tick;
+}
+
+static struct timespec
+tick_to_timespec(uint64_t tick)
+{
+	return (struct timespec) {
+		.tv_sec = (time_t)(tick / TIMER_WHEEL_TICKS_PER_SEC),
+		.tv_nsec = (long)(tick % TIMER_WHEEL_TICKS_PER_SEC) *
+		    TIMER_WHEEL_TICK_NANOS,
+	};
+}
+
+static void
+timer_wheel_insert(TimerWheel *wheel, TimerWheelEntry *entry)
+{
+	uint64_t expiry_tick = MAX(entry->expiry_tick, wheel->current_tick);
+	uint64_t delta = expiry_tick - wheel->current_tick;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		if (delta < (uint64_t)1 << timer_wheel_level_shift(level + 1)) {
+			uint64_t slot = (expiry_tick >>
+					    timer_wheel_level_shift(level)) &
+			    TIMER_WHEEL_SLOT_MASK;
+			LIST_INSERT_HEAD(&wheel->slots[level][slot], /**/
+			    entry, entry);
+			return;
+		}
+	}
+
+	LIST_INSERT_HEAD(&wheel->overflow, entry, entry);
+}
+
+static void
+timer_wheel_cascade(TimerWheel *wheel, TimerWheelList *list)
+{
+	TimerWheelList entries = LIST_HEAD_INITIALIZER(entries);
+	TimerWheelEntry *entry;
+
+	/* Entries of the overflow list might be put back into it. */
+	while ((entry = LIST_FIRST(list)) != NULL) {
+		LIST_REMOVE(entry, entry);
+		LIST_INSERT_HEAD(&entries, entry, entry);
+	}
+
+	while ((entry = LIST_FIRST(&entries)) != NULL) {
+		LIST_REMOVE(entry, entry);
+		timer_wheel_insert(wheel, entry);
+	}
+}
+
+static void
+timer_wheel_fire(TimerWheelEntry *entry)
+{
+	struct kevent kevs[2];
+
+	EV_SET(&kevs[0], 0, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, 0);
+	EV_SET(&kevs[1], 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+
+	(void)kevent(entry->kq, kevs, 2, NULL, 0, NULL);
+}
+
+static void
+timer_wheel_process_tick(TimerWheel *wheel)
+{
+	uint64_t const tick = wheel->current_tick;
+
+	/* Move entries down from the highest level first. */
+	if ((tick &
+		(((uint64_t)1 << timer_wheel_level_shift(TIMER_WHEEL_LEVELS)) -
+		    1)) == 0) {
+		timer_wheel_cascade(wheel, &wheel->overflow);
+	}
+	for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+		unsigned int shift = timer_wheel_level_shift(level);
+		if ((tick & (((uint64_t)1 << shift) - 1)) == 0) {
+			timer_wheel_cascade(wheel,
+			    &wheel->slots[level]
+					 [(tick >> shift) & TIMER_WHEEL_SLOT_MASK]);
+		}
+	}
+
+	TimerWheelList *list = &wheel->slots[0][tick & TIMER_WHEEL_SLOT_MASK];
+	TimerWheelEntry *entry;
+	while ((entry = LIST_FIRST(list)) != NULL) {
+		assert(entry->expiry_tick <= tick);
+
+		LIST_REMOVE(entry, entry);
+		entry->is_scheduled = false;
+		entry->has_fired = true;
+		--wheel->nr_entries;
+
+		timer_wheel_fire(entry);
+	}
+}
+
+/*
+ * Returns the next tick that either fires entries or moves entries down
+ * to a lower level.
+ */
+static uint64_t
+timer_wheel_next_tick(TimerWheel const *wheel)
+{
+	if (wheel->nr_entries == 0) {
+		return UINT64_MAX;
+	}
+
+	uint64_t next_tick = UINT64_MAX;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		unsigned int shift = timer_wheel_level_shift(level);
+		uint64_t step = (uint64_t)1 << shift;
+		uint64_t tick = (wheel->current_tick + step - 1) & ~(step - 1);
+
+		for (int i = 0; i < TIMER_WHEEL_SLOTS && tick < next_tick;
+		     ++i, tick += step) {
+			if (!LIST_EMPTY(&wheel->slots[level]
+						  [(tick >> shift) &
+						      TIMER_WHEEL_SLOT_MASK])) {
+				next_tick = tick;
+				break;
+			}
+		}
+	}
+
+	if (!LIST_EMPTY(&wheel->overflow)) {
+		uint64_t step = (uint64_t)1
+		    << timer_wheel_level_shift(TIMER_WHEEL_LEVELS);
+		next_tick = MIN(next_tick,
+		    (wheel->current_tick + step - 1) & ~(step - 1));
+	}
+
+	return next_tick;
+}
+
+static void
+timer_wheel_advance(TimerWheel *wheel, uint64_t now_tick)
+{
+	while (wheel->current_tick <= now_tick) {
+		uint64_t next_tick = timer_wheel_next_tick(wheel);
+		if (next_tick > now_tick) {
+			wheel->current_tick = now_tick + 1;
+			break;
+		}
+
+		wheel->current_tick = next_tick;
+		timer_wheel_process_tick(wheel);
+		++wheel->current_tick;
+	}
+}
+
+static void *
+timer_wheel_thread(void *arg)
+{
+	TimerWheel *wheel = arg;
+
+	(void)pthread_mutex_lock(&wheel->mutex);
+	for (;;) {
+		struct timespec now;
+		if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+			/* Should not happen. Try again later. */
+			now = tick_to_timespec(wheel->current_tick);
+		} else {
+			timer_wheel_advance(wheel,
+			    timespec_to_tick(&now, false));
+		}
+
+		uint64_t wakeup_tick = wheel->wakeup_tick =
+		    timer_wheel_next_tick(wheel);
+		(void)pthread_mutex_unlock(&wheel->mutex);
+
+		struct timespec timeout;
+		if (wakeup_tick != UINT64_MAX) {
+			struct timespec wakeup = tick_to_timespec(wakeup_tick);
+			if (!timespecsub_safe(&wakeup, &now, &timeout) ||
+			    timeout.tv_sec < 0) {
+				timeout = (struct timespec) { 0, 0 };
+			}
+		}
+
+		struct kevent kev;
+		(void)kevent(wheel->kq, NULL, 0, &kev, 1,
+		    wakeup_tick == UINT64_MAX ? NULL : &timeout);
+
+		(void)pthread_mutex_lock(&wheel->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * A forked child has neither the wheel thread nor its kqueue. Entries
+ * scheduled at the time of the fork are dropped, and the next call to
+ * timer_wheel_schedule() starts a new thread.
+ */
+static void
+timer_wheel_atfork_prepare(void)
+{
+	(void)pthread_mutex_lock(&timer_wheel.mutex);
+}
+
+static void
+timer_wheel_atfork_parent(void)
+{
+	(void)pthread_mutex_unlock(&timer_wheel.mutex);
+}
+
+static void
+timer_wheel_forget_list(TimerWheelList *list)
+{
+	TimerWheelEntry *entry;
+	while ((entry = LIST_FIRST(list)) != NULL) {
+		LIST_REMOVE(entry, entry);
+		entry->is_scheduled = false;
+	}
+}
+
+static void
+timer_wheel_atfork_child(void)
+{
+	TimerWheel *wheel = &timer_wheel;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		for (int i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+			timer_wheel_forget_list(&wheel->slots[level][i]);
+		}
+	}
+	timer_wheel_forget_list(&wheel->overflow);
+
+	wheel->nr_entries = 0;
+	wheel->wakeup_tick = UINT64_MAX;
+	wheel->kq = -1;
+	wheel->is_running = false;
+
+	(void)pthread_mutex_unlock(&wheel->mutex);
+}
+
+static pthread_once_t timer_wheel_atfork_once = PTHREAD_ONCE_INIT;
+static errno_t timer_wheel_atfork_error;
+
+static void
+timer_wheel_register_atfork(void)
+{
+	timer_wheel_atfork_error = pthread_atfork(timer_wheel_atfork_prepare,
+	    timer_wheel_atfork_parent, timer_wheel_atfork_child);
+}
+
+static errno_t
+timer_wheel_start(TimerWheel *wheel)
+{
+	errno_t ec;
+
+	(void)pthread_once(&timer_wheel_atfork_once,
+	    timer_wheel_register_atfork);
+	if (timer_wheel_atfork_error != 0) {
+		return timer_wheel_atfork_error;
+	}
+
+	int kq = kqueue1(O_CLOEXEC);
+	if (kq < 0) {
+		return errno;
+	}
+
+	struct kevent kev;
+	EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		ec = errno;
+		goto out_close;
+	}
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		ec = errno;
+		goto out_close;
+	}
+
+	wheel->kq = kq;
+	wheel->current_tick = timespec_to_tick(&now, false);
+	wheel->wakeup_tick = UINT64_MAX;
+
+	sigset_t set;
+	if (sigfillset(&set) < 0) {
+		ec = errno;
+		goto out_close;
+	}
+
+	sigset_t oldset;
+	if ((ec = pthread_sigmask(SIG_BLOCK, &set, &oldset)) != 0) {
+		goto out_close;
+	}
+
+	pthread_t thread;
+	ec = pthread_create(&thread, NULL, timer_wheel_thread, wheel);
+
+	(void)pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (ec != 0) {
+		goto out_close;
+	}
+
+	(void)pthread_detach(thread);
+
+	wheel->is_running = true;
+	return 0;
+
+out_close:
+	(void)real_close(kq);
+	return ec;
+}
+
+static void
+timer_wheel_remove(TimerWheel *wheel, TimerWheelEntry *entry)
+{
+	if (entry->is_scheduled) {
+		LIST_REMOVE(entry, entry);
+		entry->is_scheduled = false;
+		--wheel->nr_entries;
+	}
+}
+
+void
+timer_wheel_entry_init(TimerWheelEntry *entry)
+{
+	*entry = (TimerWheelEntry) { .kq = -1 };
+}
+
+void
+timer_wheel_entry_terminate(TimerWheelEntry *entry)
+{
+	(void)timer_wheel_cancel(entry);
+
+	/* The wheel thread is done with the entry once it is cancelled. */
+	if (entry->kq >= 0) {
+		(void)real_close(entry->kq);
+		entry->kq = -1;
+	}
+}
+
+errno_t
+timer_wheel_schedule(TimerWheelEntry *entry, int kq,
+    struct timespec const *deadline)
+{
+	errno_t ec;
+	TimerWheel *wheel = &timer_wheel;
+
+	if (entry->kq < 0 &&
+	    (entry->kq = real_fcntl(kq, F_DUPFD_CLOEXEC, 0)) < 0) {
+		return errno;
+	}
+
+	(void)pthread_mutex_lock(&wheel->mutex);
+
+	if (!wheel->is_running && (ec = timer_wheel_start(wheel)) != 0) {
+		goto out;
+	}
+
+	timer_wheel_remove(wheel, entry);
+
+	/* Nothing is left to process, so the wheel can be moved to now. */
+	struct timespec now;
+	if (wheel->nr_entries == 0 &&
+	    clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+		wheel->current_tick = MAX(wheel->current_tick,
+		    timespec_to_tick(&now, false));
+	}
+
+	entry->expiry_tick = timespec_to_tick(deadline, true);
+	entry->is_scheduled = true;
+	entry->has_fired = false;
+	timer_wheel_insert(wheel, entry);
+	++wheel->nr_entries;
+
+	if (entry->expiry_tick < wheel->wakeup_tick) {
+		struct kevent kev;
+		EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+		if (kevent(wheel->kq, &kev, 1, NULL, 0, NULL) < 0) {
+			ec = errno;
+			timer_wheel_remove(wheel, entry);
+			goto out;
+		}
+
+		wheel->wakeup_tick = entry->expiry_tick;
+	}
+
+	ec = 0;
+
+out:
+	(void)pthread_mutex_unlock(&wheel->mutex);
+	return ec;
+}
+
+bool
+timer_wheel_cancel(TimerWheelEntry *entry)
+{
+	TimerWheel *wheel = &timer_wheel;
+
+	(void)pthread_mutex_lock(&wheel->mutex);
+	timer_wheel_remove(wheel, entry);
+	bool has_fired = entry->has_fired;
+	entry->has_fired = false;
+	(void)pthread_mutex_unlock(&wheel->mutex);
+
+	return has_fired;
+}
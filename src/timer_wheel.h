@@ -0,0 +1,44 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <sys/types.h>
+
+#include <sys/event.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <time.h>
+
+#ifndef EVFILT_USER
+#error "The timer wheel needs EVFILT_USER."
+#endif
+
+/*
+ * A process wide hierarchical timer wheel on CLOCK_MONOTONIC, driven by a
+ * single thread. When an entry expires, a one-shot EVFILT_USER event with
+ * ident 0 is triggered on its kqueue.
+ */
+typedef struct timer_wheel_entry_ {
+	LIST_ENTRY(timer_wheel_entry_) entry;
+	uint64_t expiry_tick;
+	/* Our own duplicate of the kqueue, so that the fd number cannot be
+	 * reused while the entry is alive. */
+	int kq;
+	bool is_scheduled;
+	bool has_fired;
+} TimerWheelEntry;
+
+void timer_wheel_entry_init(TimerWheelEntry *entry);
+void timer_wheel_entry_terminate(TimerWheelEntry *entry);
+
+errno_t timer_wheel_schedule(TimerWheelEntry *entry, int kq,
+    struct timespec const *deadline);
+// Returns true if the entry has fired since it was last scheduled, i.e. if
+// there may be an EVFILT_USER event left in its kqueue.
+bool timer_wheel_cancel(TimerWheelEntry *entry);
+
+#endif
@@ -105,12 +105,21 @@ timerfd_realtime_change(FileDescription *desc, int kq)
 	(void)pthread_mutex_unlock(&desc->mutex);
 }
 
+static void
+timerfd_set_timer_slack(FileDescription *desc, long slack_nanos)
+{
+	(void)pthread_mutex_lock(&desc->mutex);
+	timerfd_ctx_set_timer_slack(&desc->ctx.timerfd, slack_nanos);
+	(void)pthread_mutex_unlock(&desc->mutex);
+}
+
 static struct file_description_vtable const timerfd_vtable = {
 	.read_fun = timerfd_read,
 	.write_fun = fd_context_default_write,
 	.close_fun = timerfd_close,
 	.poll_fun = timerfd_poll,
 	.realtime_change_fun = timerfd_realtime_change,
+	.set_timer_slack_fun = timerfd_set_timer_slack,
 };
 
 static errno_t
@@ -37,6 +37,7 @@ timerfd_ctx_disarm(TimerFDCtx *timerfd)
 	timerfd->current_itimerspec.it_value.tv_sec = 0;
 	timerfd->current_itimerspec.it_value.tv_nsec = 0;
 	timerfd->timer_type = TIMER_TYPE_UNSPECIFIED;
+	timerfd->is_periodic_kevent = false;
 }
 
 static errno_t
@@ -271,7 +272,10 @@ timerfd_ctx_update_to_current_time(TimerFDCtx *timerfd,
 
 			assert(expirations >= 0);
 
-			timerfd->nr_expirations += (uint64_t)expirations;
+			/* A periodic kevent counts the expirations itself. */
+			if (!timerfd->is_periodic_kevent) {
+				timerfd->nr_expirations += (uint64_t)expirations;
+			}
 			timerfd->current_itimerspec.it_value = next_ts;
 		}
 	} else {
@@ -328,34 +332,43 @@ round_up_millis(int64_t millis, int64_t *result)
 }
 #endif
 
-static errno_t
-timerfd_ctx_register_event(TimerFDCtx *timerfd, int kq,
-    struct timespec const *new, struct timespec const *current_time)
-{
-	(void)timerfd;
-	assert(new->tv_sec != 0 || new->tv_nsec != 0);
+typedef enum {
+	TIMER_PRECISION_NANOSECONDS,
+	TIMER_PRECISION_MICROSECONDS,
+	TIMER_PRECISION_MILLISECONDS,
+} TimerPrecision;
 
-	struct timespec diff_time;
-	if (!timespecsub_safe(new, current_time, &diff_time) ||
-	    diff_time.tv_sec < 0) {
-		diff_time.tv_sec = 0;
-		diff_time.tv_nsec = 0;
-	}
-
-	struct kevent kev[2];
-	bool kev_is_set = false;
+/* Finest unit of EVFILT_TIMER the kernel has not rejected yet. */
+static atomic_int timerfd_timer_precision = TIMER_PRECISION_NANOSECONDS;
 
-	/* Let's hope nobody needs timeouts larger than 10 years. */
-	if (diff_time.tv_sec >= 315360000) {
-		goto out;
+static bool
+timerfd_ctx_set_timer_kevent(struct kevent *kev, struct timespec const *ts,
+    unsigned short flags, TimerPrecision precision,
+    TimerPrecision *used_precision, bool *is_exact)
+{
+#ifdef NOTE_NSECONDS
+	if (precision <= TIMER_PRECISION_NANOSECONDS) {
+		int64_t nanos;
+
+		/* The data field might be only 32 bit wide, see below. */
+		if (ts_to_nanos(ts, &nanos) == 0 &&
+		    !__builtin_add_overflow(nanos, 0, &kev->data)) {
+			EV_SET(kev, 0, EVFILT_TIMER, flags, /**/
+			    NOTE_NSECONDS, nanos, 0);
+			*used_precision = TIMER_PRECISION_NANOSECONDS;
+			*is_exact = true;
+			return true;
+		}
 	}
+#endif
 
 #ifdef NOTE_USECONDS
-	if (!kev_is_set) {
-		int64_t micros = (int64_t)diff_time.tv_sec * 1000000 +
-		    diff_time.tv_nsec / 1000;
+	if (precision <= TIMER_PRECISION_MICROSECONDS) {
+		int64_t micros = (int64_t)ts->tv_sec * 1000000 +
+		    ts->tv_nsec / 1000;
 
-		if ((diff_time.tv_nsec % 1000) != 0) {
+		*is_exact = (ts->tv_nsec % 1000) == 0;
+		if (!*is_exact) {
 			++micros;
 		}
 
@@ -364,46 +377,182 @@ timerfd_ctx_register_event(TimerFDCtx *timerfd, int kq,
 
 		/* The data field is only 32 bit wide on FreeBSD 11 i386. If
 		 * this would overflow, try again with milliseconds. */
-		if (!__builtin_add_overflow(micros, 0, &kev[1].data)) {
-			EV_SET(&kev[1], 0, EVFILT_TIMER,
-			    EV_ADD | EV_ONESHOT | EV_RECEIPT, /**/
+		if (!__builtin_add_overflow(micros, 0, &kev->data)) {
+			EV_SET(kev, 0, EVFILT_TIMER, flags, /**/
 			    NOTE_USECONDS, micros, 0);
-			kev_is_set = true;
+			*used_precision = TIMER_PRECISION_MICROSECONDS;
+			return true;
 		}
 	}
 #endif
 
-	if (!kev_is_set) {
 #ifdef QUIRKY_EVFILT_TIMER
-		/* Let's hope 49 days are enough. */
-		if (diff_time.tv_sec >= 4233600) {
-			goto out;
-		}
+	/* Let's hope 49 days are enough. */
+	if (ts->tv_sec >= 4233600) {
+		return false;
+	}
 #endif
 
-		int64_t millis = (int64_t)diff_time.tv_sec * 1000 +
-		    diff_time.tv_nsec / 1000000;
+	int64_t millis = (int64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
 
-		if ((diff_time.tv_nsec % 1000000) != 0) {
-			++millis;
-		}
+	*is_exact = (ts->tv_nsec % 1000000) == 0;
+	if (!*is_exact) {
+		++millis;
+	}
 
 #ifdef QUIRKY_EVFILT_TIMER
-		if (millis != 0 && !round_up_millis(millis, &millis)) {
-			goto out;
+	if (millis != 0) {
+		if (!round_up_millis(millis, &millis)) {
+			return false;
 		}
+		*is_exact = false;
+	}
 #endif
 
-		if (__builtin_add_overflow(millis, 0, &kev[1].data)) {
-			goto out;
-		}
-		EV_SET(&kev[1], 0, EVFILT_TIMER,      /**/
-		    EV_ADD | EV_ONESHOT | EV_RECEIPT, /**/
-		    0, millis, 0);
-		kev_is_set = true;
+	if (__builtin_add_overflow(millis, 0, &kev->data)) {
+		return false;
+	}
+	EV_SET(kev, 0, EVFILT_TIMER, flags, 0, millis, 0);
+	*used_precision = TIMER_PRECISION_MILLISECONDS;
+	return true;
+}
+
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+/*
+ * Removes the timer from the timer wheel. Only if it has fired or if an
+ * EVFILT_TIMER was used before, a system call is needed.
+ */
+static void
+timerfd_ctx_cancel_timer_wheel(TimerFDCtx *timerfd, int kq,
+    bool delete_evfilt_timer)
+{
+	struct kevent kev[2];
+	int n = 0;
+
+	if (timer_wheel_cancel(&timerfd->timer_wheel_entry)) {
+		EV_SET(&kev[n++], 0, EVFILT_USER, EV_DELETE | EV_RECEIPT, /**/
+		    0, 0, 0);
+	}
+	if (delete_evfilt_timer && timerfd->uses_evfilt_timer) {
+		EV_SET(&kev[n++], 0, EVFILT_TIMER, EV_DELETE | EV_RECEIPT, /**/
+		    0, 0, 0);
+		timerfd->uses_evfilt_timer = false;
+	}
+
+	if (n > 0) {
+		(void)kevent(kq, kev, n, kev, n, NULL);
+	}
+}
+#endif
+
+static void
+timerfd_ctx_delete_timer(TimerFDCtx *timerfd, int kq)
+{
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+	timerfd_ctx_cancel_timer_wheel(timerfd, kq, true);
+#else
+	(void)timerfd;
+
+	struct kevent kev;
+
+	EV_SET(&kev, 0, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
+	(void)kevent(kq, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/*
+ * If the first expiration is exactly one interval away, a repeating
+ * EVFILT_TIMER is registered. Absolute CLOCK_REALTIME timers ('can_jump')
+ * are re-armed when the clock is stepped, so they never get one.
+ */
+static errno_t
+timerfd_ctx_register_event(TimerFDCtx *timerfd, int kq,
+    struct itimerspec const *new_itimerspec, bool can_jump,
+    struct timespec const *current_time)
+{
+	struct timespec const *new = &new_itimerspec->it_value;
+	struct timespec const *interval = can_jump ?
+	    NULL :
+	    &new_itimerspec->it_interval;
+
+	assert(new->tv_sec != 0 || new->tv_nsec != 0);
+
+	/*
+	 * Rounding up to absolute multiples of the slack lets timers with
+	 * nearby expirations fire together. Reads still count expirations
+	 * based on the exact times. A repeating EVFILT_TIMER would not stay
+	 * on those multiples.
+	 */
+	struct timespec coalesced;
+	if (timerfd->timer_slack_nanos != 0 &&
+	    timespec_round_up(new, timerfd->timer_slack_nanos, &coalesced)) {
+		new = &coalesced;
+		interval = NULL;
+	}
+
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+	if (!can_jump) {
+		timerfd_ctx_cancel_timer_wheel(timerfd, kq, true);
+		timerfd->is_periodic_kevent = false;
+
+		/* Those timers are on CLOCK_MONOTONIC, just like the wheel. */
+		return timer_wheel_schedule(&timerfd->timer_wheel_entry, kq,
+		    new);
+	}
+
+	timerfd_ctx_cancel_timer_wheel(timerfd, kq, false);
+	timerfd->uses_evfilt_timer = true;
+#endif
+
+	struct timespec diff_time;
+	if (!timespecsub_safe(new, current_time, &diff_time) ||
+	    diff_time.tv_sec < 0) {
+		diff_time.tv_sec = 0;
+		diff_time.tv_nsec = 0;
 	}
 
-	assert(kev_is_set);
+	struct kevent kev[2];
+	bool kev_is_set = false;
+	bool is_periodic = false;
+	TimerPrecision precision = (TimerPrecision)atomic_load_explicit(
+	    &timerfd_timer_precision, memory_order_relaxed);
+	TimerPrecision used_precision;
+
+	/* Let's hope nobody needs timeouts larger than 10 years. */
+	if (diff_time.tv_sec >= 315360000) {
+		goto out;
+	}
+
+retry:;
+	bool is_exact;
+	if (!timerfd_ctx_set_timer_kevent(&kev[1], &diff_time,
+		EV_ADD | EV_ONESHOT | EV_RECEIPT, precision, &used_precision,
+		&is_exact)) {
+		goto out;
+	}
+	kev_is_set = true;
+
+#ifndef QUIRKY_EVFILT_TIMER
+	if (interval != NULL &&
+	    (interval->tv_sec != 0 || interval->tv_nsec != 0)) {
+		struct kevent interval_kev;
+		TimerPrecision interval_precision;
+		bool interval_is_exact;
+
+		/* A rounded period would let the timer drift. */
+		if (timerfd_ctx_set_timer_kevent(&interval_kev, interval,
+			EV_ADD | EV_RECEIPT, precision, &interval_precision,
+			&interval_is_exact) &&
+		    interval_is_exact &&
+		    interval_kev.fflags == kev[1].fflags &&
+		    interval_kev.data == kev[1].data) {
+			kev[1] = interval_kev;
+			is_periodic = true;
+		}
+	}
+#else
+	(void)interval;
+#endif
 
 #ifdef QUIRK_EVFILT_TIMER_DISALLOWS_ONESHOT_TIMEOUT_ZERO
 	if (kev[1].data == 0) {
@@ -427,10 +576,22 @@ out:
 	assert(n == kev_size);
 	assert((kev[0].flags & EV_ERROR) != 0);
 	if (!kev_is_set) {
+		timerfd->is_periodic_kevent = false;
 		return 0;
 	}
 
 	assert((kev[1].flags & EV_ERROR) != 0);
+	if (kev[1].data == EINVAL &&
+	    used_precision != TIMER_PRECISION_MILLISECONDS) {
+		/* The kernel doesn't know this unit. Fall back to the next
+		 * coarser one. */
+		precision = (TimerPrecision)(used_precision + 1);
+		atomic_store_explicit(&timerfd_timer_precision, (int)precision,
+		    memory_order_relaxed);
+		goto retry;
+	}
+
+	timerfd->is_periodic_kevent = is_periodic && kev[1].data == 0;
 	return (errno_t)kev[1].data;
 }
 
@@ -442,6 +603,9 @@ timerfd_ctx_init(TimerFDCtx *timerfd, int clockid)
 	*timerfd = (TimerFDCtx) {
 		.clockid = (clockid_t)clockid,
 	};
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+	timer_wheel_entry_init(&timerfd->timer_wheel_entry);
+#endif
 
 	return 0;
 }
@@ -449,7 +613,11 @@ timerfd_ctx_init(TimerFDCtx *timerfd, int clockid)
 errno_t
 timerfd_ctx_terminate(TimerFDCtx *timerfd)
 {
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+	timer_wheel_entry_terminate(&timerfd->timer_wheel_entry);
+#else
 	(void)timerfd;
+#endif
 
 	return 0;
 }
@@ -504,10 +672,7 @@ timerfd_ctx_settime(TimerFDCtx *timerfd, int kq, /**/
 	}
 
 	if (new->it_value.tv_sec == 0 && new->it_value.tv_nsec == 0) {
-		struct kevent kev;
-
-		EV_SET(&kev, 0, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
-		(void)kevent(kq, &kev, 1, NULL, 0, NULL);
+		timerfd_ctx_delete_timer(timerfd, kq);
 
 		timerfd_ctx_disarm(timerfd);
 		timerfd->is_cancel_on_set = false;
@@ -541,8 +706,11 @@ timerfd_ctx_settime(TimerFDCtx *timerfd, int kq, /**/
 			}
 		}
 
+		bool can_jump = timerfd->clockid == CLOCK_REALTIME &&
+		    new_timer_type == TIMER_TYPE_ABSOLUTE;
+
 		if ((ec = timerfd_ctx_register_event(timerfd, kq,
-			 &new_absolute.it_value, &current_time)) != 0) {
+			 &new_absolute, can_jump, &current_time)) != 0) {
 			return ec;
 		}
 
@@ -583,6 +751,19 @@ timerfd_ctx_gettime(TimerFDCtx *timerfd, struct itimerspec *cur)
 	return 0;
 }
 
+void
+timerfd_ctx_set_timer_slack(TimerFDCtx *timerfd, long slack_nanos)
+{
+	assert(slack_nanos >= 0);
+
+	/*
+	 * A pending expiration is not moved. The new slack applies whenever
+	 * the timer is armed next, which includes the re-arming of periodic
+	 * timers on read.
+	 */
+	timerfd->timer_slack_nanos = slack_nanos;
+}
+
 static void
 timerfd_ctx_rearm_kevent(TimerFDCtx *timerfd, int kq,
     struct timespec const *current_time,
@@ -590,16 +771,13 @@ timerfd_ctx_rearm_kevent(TimerFDCtx *timerfd, int kq,
 {
 	if (!timerfd_ctx_is_disarmed(timerfd)) {
 		if (timerfd_ctx_register_event(timerfd, kq,
-			&timerfd->current_itimerspec.it_value,
-			current_time) != 0) {
+			&timerfd->current_itimerspec,
+			timerfd_ctx_can_jump(timerfd), current_time) != 0) {
 			timerfd_ctx_disarm(timerfd);
 		}
 	} else {
 		if (need_kevent_delete_on_disarmed_timer) {
-			struct kevent kev;
-
-			EV_SET(&kev, 0, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
-			(void)kevent(kq, &kev, 1, NULL, 0, NULL);
+			timerfd_ctx_delete_timer(timerfd, kq);
 		}
 	}
 }
@@ -613,8 +791,11 @@ timerfd_ctx_read(TimerFDCtx *timerfd, int kq, uint64_t *value)
 		return EAGAIN;
 	}
 
+	bool const is_periodic_kevent = timerfd->is_periodic_kevent;
+
 	bool got_kevent = false;
 	unsigned long event_ident;
+	uint64_t nr_kevent_expirations = 0;
 	{
 		struct kevent kevs[3];
 		int n = kevent(kq, NULL, 0, kevs, 3,
@@ -624,7 +805,23 @@ timerfd_ctx_read(TimerFDCtx *timerfd, int kq, uint64_t *value)
 		}
 
 		for (int i = 0; i < n; ++i) {
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+			assert(kevs[i].filter == EVFILT_TIMER ||
+			    kevs[i].filter == EVFILT_USER);
+
+			/* The one-shot event of the timer wheel is consumed
+			 * now, so it doesn't need to be deleted on re-arm. */
+			if (kevs[i].filter == EVFILT_USER) {
+				(void)timer_wheel_cancel(
+				    &timerfd->timer_wheel_entry);
+			}
+#else
 			assert(kevs[i].filter == EVFILT_TIMER);
+#endif
+
+			if (kevs[i].ident == 0 && kevs[i].data > 0) {
+				nr_kevent_expirations += (uint64_t)kevs[i].data;
+			}
 
 			if (!got_kevent) {
 				event_ident = kevs[i].ident;
@@ -680,6 +877,10 @@ timerfd_ctx_read(TimerFDCtx *timerfd, int kq, uint64_t *value)
 		nr_expirations = timerfd->nr_expirations;
 		timerfd->nr_expirations = 0;
 
+		if (is_periodic_kevent) {
+			nr_expirations += nr_kevent_expirations;
+		}
+
 		if (nr_expirations == 0) {
 			if (!got_kevent) {
 				return EAGAIN;
@@ -708,8 +909,10 @@ timerfd_ctx_read(TimerFDCtx *timerfd, int kq, uint64_t *value)
 		timerfd_ctx_is_interval_timer(timerfd) &&
 		!timerfd->is_cancel_on_set));
 
-	timerfd_ctx_rearm_kevent(timerfd, kq, &current_time,
-	    (!got_kevent || event_ident != 0));
+	if (!timerfd->is_periodic_kevent) {
+		timerfd_ctx_rearm_kevent(timerfd, kq, &current_time,
+		    (!got_kevent || event_ident != 0 || is_periodic_kevent));
+	}
 
 	if (is_cancelled) {
 		return ECANCELED;
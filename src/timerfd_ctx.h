@@ -10,6 +10,10 @@
 #include <pthread.h>
 #include <time.h>
 
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+#include "timer_wheel.h"
+#endif
+
 typedef enum {
 	TIMER_TYPE_UNSPECIFIED,
 	TIMER_TYPE_RELATIVE,
@@ -31,6 +35,22 @@ typedef struct {
 	 */
 	struct itimerspec current_itimerspec;
 	uint64_t nr_expirations;
+	/*
+	 * The EVFILT_TIMER repeats with 'it_interval'. Expirations are then
+	 * counted by the kernel and the timer is never re-armed on read.
+	 */
+	bool is_periodic_kevent;
+	/* Expirations are delayed to multiples of this, if != 0. */
+	long timer_slack_nanos;
+#ifdef EPOLL_SHIM_TIMER_WHEEL
+	/*
+	 * Timers on the monotonic clock are put on the timer wheel instead
+	 * of registering an EVFILT_TIMER. 'uses_evfilt_timer' is set if an
+	 * EVFILT_TIMER might still be registered.
+	 */
+	TimerWheelEntry timer_wheel_entry;
+	bool uses_evfilt_timer;
+#endif
 } TimerFDCtx;
 
 errno_t timerfd_ctx_init(TimerFDCtx *timerfd, int clockid);
@@ -40,6 +60,7 @@ errno_t timerfd_ctx_settime(TimerFDCtx *timerfd, int kq, /**/
     bool is_abstime, bool is_cancel_on_set,		 /**/
     struct itimerspec const *new, struct itimerspec *old);
 errno_t timerfd_ctx_gettime(TimerFDCtx *timerfd, struct itimerspec *cur);
+void timerfd_ctx_set_timer_slack(TimerFDCtx *timerfd, long slack_nanos);
 
 errno_t timerfd_ctx_read(TimerFDCtx *timerfd, int kq, uint64_t *value);
 void timerfd_ctx_poll(TimerFDCtx *timerfd, int kq, uint32_t *revents);
@@ -1,6 +1,7 @@
 #include "timespec_util.h"
 
 #include <assert.h>
+#include <stdint.h>
 
 bool
 timespec_is_valid(struct timespec const *ts)
@@ -60,3 +61,30 @@ timespecsub_safe(struct timespec const *tsp, struct timespec const *usp,
 
 	return true;
 }
+
+bool
+timespec_round_up(struct timespec const *tsp, long granularity_nanos,
+    struct timespec *vsp)
+{
+	assert(timespec_is_valid(tsp));
+	assert(granularity_nanos > 0);
+
+	int64_t nanos;
+	if (__builtin_mul_overflow(tsp->tv_sec, 1000000000, &nanos) ||
+	    __builtin_add_overflow(nanos, tsp->tv_nsec, &nanos)) {
+		return false;
+	}
+
+	int64_t remainder = nanos % granularity_nanos;
+	if (remainder != 0 &&
+	    __builtin_add_overflow(nanos, granularity_nanos - remainder,
+		&nanos)) {
+		return false;
+	}
+
+	*vsp = (struct timespec) {
+		.tv_sec = nanos / 1000000000,
+		.tv_nsec = nanos % 1000000000,
+	};
+	return true;
+}
@@ -33,5 +33,7 @@ bool timespecadd_safe(struct timespec const *tsp, struct timespec const *usp,
     struct timespec *vsp);
 bool timespecsub_safe(struct timespec const *tsp, struct timespec const *usp,
     struct timespec *vsp);
+bool timespec_round_up(struct timespec const *tsp, long granularity_nanos,
+    struct timespec *vsp);
 
 #endif
@@ -0,0 +1,154 @@
+#include <atf-c.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include <epoch.h>
+
+#define ALIVE (0x600d)
+#define DEAD (0xdead)
+
+struct object {
+	EpochEntry epoch_entry;
+	int value;
+};
+
+static atomic_int nr_destroyed;
+
+static void
+object_destroy(EpochEntry *entry)
+{
+	struct object *object = (struct object *)entry;
+
+	/* Keep the memory around, so that late readers see 'DEAD'. */
+	object->value = DEAD;
+	atomic_fetch_add(&nr_destroyed, 1);
+}
+
+ATF_TC_WITHOUT_HEAD(epoch__retire_waits_for_readers);
+ATF_TC_BODY(epoch__retire_waits_for_readers, tc)
+{
+	EpochDomain domain;
+	ATF_REQUIRE(epoch_domain_init(&domain) == 0);
+
+	atomic_store(&nr_destroyed, 0);
+
+	struct object object = { .value = ALIVE };
+
+	EpochRecord *record = epoch_enter(&domain);
+	epoch_retire(&domain, &object.epoch_entry, object_destroy);
+	for (int i = 0; i < 10; ++i) {
+		epoch_reclaim(&domain);
+	}
+	ATF_REQUIRE(object.value == ALIVE);
+	ATF_REQUIRE(atomic_load(&nr_destroyed) == 0);
+	epoch_exit(&domain, record);
+
+	epoch_reclaim(&domain);
+	ATF_REQUIRE(object.value == DEAD);
+	ATF_REQUIRE(atomic_load(&nr_destroyed) == 1);
+
+	epoch_domain_terminate(&domain);
+}
+
+ATF_TC_WITHOUT_HEAD(epoch__terminate_destroys_retired);
+ATF_TC_BODY(epoch__terminate_destroys_retired, tc)
+{
+	EpochDomain domain;
+	ATF_REQUIRE(epoch_domain_init(&domain) == 0);
+
+	atomic_store(&nr_destroyed, 0);
+
+	struct object object = { .value = ALIVE };
+
+	EpochRecord *record = epoch_enter(&domain);
+	epoch_retire(&domain, &object.epoch_entry, object_destroy);
+	epoch_exit(&domain, record);
+	ATF_REQUIRE(object.value == ALIVE);
+
+	epoch_domain_terminate(&domain);
+	ATF_REQUIRE(object.value == DEAD);
+	ATF_REQUIRE(atomic_load(&nr_destroyed) == 1);
+}
+
+#define NR_STRESS_READERS 8
+#define NR_STRESS_OBJECTS 100000
+
+struct stress_data {
+	EpochDomain *domain;
+	struct object *_Atomic current;
+	atomic_bool done;
+};
+
+static void *
+stress_reader(void *arg)
+{
+	struct stress_data *stress_data = arg;
+
+	while (!atomic_load(&stress_data->done)) {
+		EpochRecord *record = epoch_enter(stress_data->domain);
+		struct object *object = atomic_load(&stress_data->current);
+		for (int i = 0; i < 10; ++i) {
+			ATF_REQUIRE(object->value == ALIVE);
+		}
+		epoch_exit(stress_data->domain, record);
+	}
+
+	return NULL;
+}
+
+ATF_TC_WITHOUT_HEAD(epoch__stress);
+ATF_TC_BODY(epoch__stress, tc)
+{
+	EpochDomain domain;
+	ATF_REQUIRE(epoch_domain_init(&domain) == 0);
+
+	atomic_store(&nr_destroyed, 0);
+
+	struct object *objects = calloc(NR_STRESS_OBJECTS + 1,
+	    sizeof(struct object));
+	ATF_REQUIRE(objects != NULL);
+
+	objects[0].value = ALIVE;
+
+	struct stress_data stress_data = { .domain = &domain };
+	atomic_init(&stress_data.current, &objects[0]);
+	atomic_init(&stress_data.done, false);
+
+	pthread_t threads[NR_STRESS_READERS];
+	for (int i = 0; i < NR_STRESS_READERS; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL, /**/
+				stress_reader, &stress_data) == 0);
+	}
+
+	for (int i = 1; i <= NR_STRESS_OBJECTS; ++i) {
+		objects[i].value = ALIVE;
+		struct object *old = atomic_exchange(&stress_data.current,
+		    &objects[i]);
+		epoch_retire(&domain, &old->epoch_entry, object_destroy);
+	}
+
+	atomic_store(&stress_data.done, true);
+	for (int i = 0; i < NR_STRESS_READERS; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	epoch_reclaim(&domain);
+	epoch_reclaim(&domain);
+	ATF_REQUIRE(atomic_load(&nr_destroyed) == NR_STRESS_OBJECTS);
+	ATF_REQUIRE(objects[NR_STRESS_OBJECTS].value == ALIVE);
+
+	epoch_domain_terminate(&domain);
+	free(objects);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, epoch__retire_waits_for_readers);
+	ATF_TP_ADD_TC(tp, epoch__terminate_destroys_retired);
+	ATF_TP_ADD_TC(tp, epoch__stress);
+
+	return atf_no_error();
+}
@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -212,6 +213,55 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__fd_exhaustion, tc)
 	free(fds);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__high_fd);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__high_fd, tc)
+{
+	struct rlimit lim;
+	ATF_REQUIRE(getrlimit(RLIMIT_NOFILE, &lim) == 0);
+	struct rlimit old_lim = lim;
+	if (lim.rlim_max == RLIM_INFINITY || lim.rlim_max > 1000000) {
+		lim.rlim_cur = 1000000;
+	} else {
+		lim.rlim_cur = lim.rlim_max;
+	}
+	(void)setrlimit(RLIMIT_NOFILE, &lim);
+	ATF_REQUIRE(getrlimit(RLIMIT_NOFILE, &lim) == 0);
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+
+	int high_fd = fcntl(fds[0], F_DUPFD_CLOEXEC, (int)lim.rlim_cur - 1);
+	ATF_REQUIRE(high_fd >= 0);
+
+	struct epoll_event event = { .events = EPOLLIN };
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+	event.data.fd = high_fd;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, high_fd, &event) == 0);
+
+	uint8_t data = '\0';
+	ATF_REQUIRE(write(fds[1], &data, 1) == 1);
+
+	struct epoll_event event_result[2];
+	ATF_REQUIRE(epoll_wait(ep, event_result, 2, -1) == 2);
+	ATF_REQUIRE(event_result[0].data.fd + event_result[1].data.fd ==
+	    fds[0] + high_fd);
+
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, high_fd, NULL) == 0);
+	ATF_REQUIRE(epoll_wait(ep, event_result, 2, -1) == 1);
+	ATF_REQUIRE(event_result[0].data.fd == fds[0]);
+
+	ATF_REQUIRE(close(high_fd) == 0);
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(fds[2] == -1 || close(fds[2]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+	(void)setrlimit(RLIMIT_NOFILE, &old_lim);
+}
+
 ATF_TC_WITHOUT_HEAD(epoll__invalid_op);
 ATF_TC_BODY_FD_LEAKCHECK(epoll__invalid_op, tc)
 {
@@ -581,6 +631,166 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__modify_existing, tc)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__modify_data_only);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__modify_data_only, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = fds[0];
+
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	uint8_t data = '\0';
+	ATF_REQUIRE(write(fds[1], &data, 1) == 1);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.data.fd == fds[0]);
+
+	event.data.fd = 42;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == 42);
+
+	/* A MOD of an edge triggered fd reports pending events again. */
+	event.events = EPOLLIN | EPOLLET;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	event.data.fd = 43;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == 43);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(fds[2] == -1 || close(fds[2]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+static atomic_int nr_exclusive_woken;
+
+static void *
+exclusive_thread_fun(void *arg)
+{
+	int ep = *(int *)arg;
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	atomic_fetch_add(&nr_exclusive_woken, 1);
+
+	return NULL;
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__exclusive);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__exclusive, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+	int ep2 = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep2 >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLEXCLUSIVE | EPOLLONESHOT;
+	event.data.fd = fds[0];
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) < 0);
+
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(ep2, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) < 0);
+	event.events = EPOLLIN;
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) < 0);
+
+	uint8_t data = '\0';
+	ATF_REQUIRE(write(fds[1], &data, 1) == 1);
+
+	/* At least one of the instances must see the event. */
+	struct epoll_event event_result;
+	int n = epoll_wait(ep, &event_result, 1, 0) +
+	    epoll_wait(ep2, &event_result, 1, 0);
+	if (n == 0) {
+		ATF_REQUIRE(epoll_wait(ep2, &event_result, 1, -1) == 1);
+	}
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == fds[0]);
+
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[0], NULL) == 0);
+	ATF_REQUIRE(epoll_wait(ep2, &event_result, 1, -1) == 1);
+
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLEXCLUSIVE;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[1], &event) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep2) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+
+	/* Every event must wake exactly one of the blocked instances. */
+	fd_domain_socket(fds);
+
+	int eps[4];
+	pthread_t threads[4];
+	atomic_store(&nr_exclusive_woken, 0);
+	for (int i = 0; i < 4; ++i) {
+		eps[i] = epoll_create1(EPOLL_CLOEXEC);
+		ATF_REQUIRE(eps[i] >= 0);
+
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		event.data.fd = fds[0];
+		ATF_REQUIRE(epoll_ctl(eps[i], EPOLL_CTL_ADD, fds[0], &event) ==
+		    0);
+
+		ATF_REQUIRE(pthread_create(&threads[i], NULL,
+				&exclusive_thread_fun, &eps[i]) == 0);
+	}
+
+	/*
+	 * Racy way of making sure that all threads are waiting in epoll_wait.
+	 */
+	usleep(200000);
+
+	for (int i = 1; i <= 4; ++i) {
+		ATF_REQUIRE(write(fds[1], &data, 1) == 1);
+		for (int j = 0;
+		     j < 200 && atomic_load(&nr_exclusive_woken) < i; ++j) {
+			usleep(10000);
+		}
+		usleep(100000);
+		ATF_REQUIRE(atomic_load(&nr_exclusive_woken) == i);
+		ATF_REQUIRE(read(fds[0], &data, 1) == 1);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+		ATF_REQUIRE(close(eps[i]) == 0);
+	}
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+}
+
 ATF_TC_WITHOUT_HEAD(epoll__modify_nonexisting);
 ATF_TC_BODY_FD_LEAKCHECK(epoll__modify_nonexisting, tc)
 {
@@ -666,6 +876,56 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__poll_only_fd, tc)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__poll_only_fd_added_while_waiting);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__poll_only_fd_added_while_waiting, tc)
+{
+#ifdef __linux__
+	atf_tc_skip("Test hangs on Linux");
+#elif defined(__APPLE__)
+	atf_tc_skip("/dev/random not pollable under macOS");
+#endif
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+
+	/* Without poll-only fds the threads block in kevent(). */
+	struct epoll_event event = { .events = EPOLLIN };
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL,
+				&poll_only_fd_thread_fun, &ep) == 0);
+	}
+
+	/*
+	 * Racy way of making sure that all threads are waiting in epoll_wait.
+	 */
+	usleep(200000);
+
+	int fd = open("/dev/random", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		atf_tc_skip("This test needs /dev/random");
+	}
+
+	/* This must wake up all waiters, not only one of them. */
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event) == 0);
+
+	for (int i = 0; i < 4; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	ATF_REQUIRE(close(fd) == 0);
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(fds[2] == -1 || close(fds[2]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
 static void
 no_epollin_on_closed_empty_pipe_impl(bool do_write_data)
 {
@@ -1790,6 +2050,51 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__remove_closed_when_same_fd_open, tcptr)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__remove_closed_from_all_instances);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__remove_closed_from_all_instances, tcptr)
+{
+	int eps[3];
+	for (int i = 0; i < 3; ++i) {
+		eps[i] = epoll_create1(EPOLL_CLOEXEC);
+		ATF_REQUIRE(eps[i] >= 0);
+	}
+
+	int fds[3];
+	fd_pipe(fds);
+
+	struct epoll_event event = { .events = EPOLLIN };
+
+	/* The middle instance never watches the fd. */
+	ATF_REQUIRE(epoll_ctl(eps[0], EPOLL_CTL_ADD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(eps[2], EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	/* An instance that no longer watches the fd must not matter. */
+	int ep_del = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep_del >= 0);
+	ATF_REQUIRE(epoll_ctl(ep_del, EPOLL_CTL_ADD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(ep_del, EPOLL_CTL_DEL, fds[0], NULL) == 0);
+	ATF_REQUIRE(close(ep_del) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+
+	int p[2];
+	ATF_REQUIRE(pipe2(p, O_CLOEXEC) == 0);
+	ATF_REQUIRE(fds[0] == p[0]);
+
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE_ERRNO(ENOENT,
+		    epoll_ctl(eps[i], EPOLL_CTL_DEL, p[0], NULL) < 0);
+		ATF_REQUIRE(epoll_ctl(eps[i], EPOLL_CTL_ADD, p[0], &event) == 0);
+	}
+
+	ATF_REQUIRE(close(p[0]) == 0);
+	ATF_REQUIRE(close(p[1]) == 0);
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(close(eps[i]) == 0);
+	}
+}
+
 ATF_TC_WITHOUT_HEAD(epoll__add_different_file_with_same_fd_value);
 ATF_TC_BODY_FD_LEAKCHECK(epoll__add_different_file_with_same_fd_value, tcptr)
 {
@@ -1932,6 +2237,202 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__using_real_close, tcptr)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__nested_loop);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__nested_loop, tcptr)
+{
+	int eps[3];
+	for (int i = 0; i < 3; ++i) {
+		eps[i] = epoll_create1(EPOLL_CLOEXEC);
+		ATF_REQUIRE(eps[i] >= 0);
+	}
+
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+
+	ATF_REQUIRE(epoll_ctl(eps[0], EPOLL_CTL_ADD, eps[1], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(eps[1], EPOLL_CTL_ADD, eps[2], &event) == 0);
+
+	ATF_REQUIRE_ERRNO(ELOOP,
+	    epoll_ctl(eps[1], EPOLL_CTL_ADD, eps[0], &event) < 0);
+	ATF_REQUIRE_ERRNO(ELOOP,
+	    epoll_ctl(eps[2], EPOLL_CTL_ADD, eps[0], &event) < 0);
+
+	/* Removing the link breaks the cycle. */
+	ATF_REQUIRE(epoll_ctl(eps[0], EPOLL_CTL_DEL, eps[1], NULL) == 0);
+	ATF_REQUIRE(epoll_ctl(eps[2], EPOLL_CTL_ADD, eps[0], &event) == 0);
+
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(close(eps[i]) == 0);
+	}
+}
+
+#ifndef __linux__
+ATF_TC_WITHOUT_HEAD(epoll__ctl_batch);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__ctl_batch, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+	int fds2[3];
+	fd_pipe(fds2);
+
+	struct epoll_shim_ctl_op ops[] = {
+		{ EPOLL_CTL_ADD, fds[0], { EPOLLIN, { .fd = fds[0] } }, -1 },
+		{ EPOLL_CTL_ADD, fds2[0], { EPOLLOUT, { .fd = fds2[0] } }, -1 },
+		{ EPOLL_CTL_ADD, fds[0], { EPOLLIN, { .fd = fds[0] } }, -1 },
+		{ EPOLL_CTL_DEL, fds[1], { 0, { 0 } }, -1 },
+		{ EPOLL_CTL_MOD, fds2[0], { EPOLLIN, { .fd = fds2[0] } }, -1 },
+		{ EPOLL_CTL_ADD, ep, { EPOLLIN, { 0 } }, -1 },
+	};
+
+	ATF_REQUIRE(epoll_shim_ctl_batch(ep, ops, 6) == 3);
+	ATF_REQUIRE(ops[0].error == 0);
+	ATF_REQUIRE(ops[1].error == 0);
+	ATF_REQUIRE(ops[2].error == EEXIST);
+	ATF_REQUIRE(ops[3].error == ENOENT);
+	ATF_REQUIRE(ops[4].error == 0);
+	ATF_REQUIRE(ops[5].error == EINVAL);
+
+	ATF_REQUIRE(epoll_shim_ctl_batch(ep, NULL, 0) == 0);
+	ATF_REQUIRE_ERRNO(EINVAL, epoll_shim_ctl_batch(ep, ops, -1) < 0);
+	ATF_REQUIRE_ERRNO(EBADF, epoll_shim_ctl_batch(-1, ops, 1) < 0);
+
+	struct epoll_event event;
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+	uint8_t data = '\0';
+	ATF_REQUIRE(write(fds2[1], &data, 1) == 1);
+
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+	ATF_REQUIRE(event.data.fd == fds2[0]);
+
+	ops[0] = (struct epoll_shim_ctl_op) { EPOLL_CTL_DEL, fds[0],
+		{ 0, { 0 } }, -1 };
+	ops[1] = (struct epoll_shim_ctl_op) { EPOLL_CTL_DEL, fds2[0],
+		{ 0, { 0 } }, -1 };
+	ATF_REQUIRE(epoll_shim_ctl_batch(ep, ops, 2) == 0);
+
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(fds2[0]) == 0);
+	ATF_REQUIRE(close(fds2[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__defer_ctl);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__defer_ctl, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC | EPOLL_SHIM_DEFER_CTL);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	uint8_t data = '\0';
+	ATF_REQUIRE(write(fds[1], &data, 1) == 1);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	/* Re-arming adds filters again, so it is not deferred. */
+	event.data.fd = 42;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == 42);
+
+	event.events = EPOLLIN | EPOLLOUT;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[0], NULL) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	/* The pipe will likely reuse the number of fds[1]. */
+	event.events = EPOLLOUT;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[1], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[1], NULL) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+
+	int fds2[3];
+	fd_pipe(fds2);
+
+	event.events = EPOLLIN;
+	event.data.fd = fds2[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds2[0], &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(write(fds2[1], &data, 1) == 1);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == fds2[0]);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds2[0]) == 0);
+	ATF_REQUIRE(close(fds2[1]) == 0);
+	ATF_REQUIRE(fds2[2] == -1 || close(fds2[2]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__defer_ctl_poll);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__defer_ctl_poll, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC | EPOLL_SHIM_DEFER_CTL);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	struct pollfd pfd = { .fd = ep, .events = POLLIN };
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+	event.events = EPOLLIN | EPOLLOUT;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(poll(&pfd, 1, 1000) == 1);
+	ATF_REQUIRE(pfd.revents == POLLIN);
+
+	/* poll() on the epoll fd must see deferred changes. */
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+	/* So must an epoll instance it is added to. */
+	int ep_outer = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep_outer >= 0);
+
+	event.events = EPOLLIN | EPOLLOUT;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+
+	event.data.fd = ep;
+	ATF_REQUIRE(epoll_ctl(ep_outer, EPOLL_CTL_ADD, ep, &event) == 0);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep_outer, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(ep_outer) == 0);
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+#endif
+
 static sig_atomic_t volatile epoll_pwait_got_signal = 0;
 static void
 epoll_pwait_sighandler(int sig)
@@ -2084,6 +2585,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, epoll__poll_flags);
 	ATF_TP_ADD_TC(tp, epoll__leakcheck);
 	ATF_TP_ADD_TC(tp, epoll__fd_exhaustion);
+	ATF_TP_ADD_TC(tp, epoll__high_fd);
 	ATF_TP_ADD_TC(tp, epoll__invalid_op);
 	ATF_TP_ADD_TC(tp, epoll__invalid_op2);
 	ATF_TP_ADD_TC(tp, epoll__simple_wait);
@@ -2095,8 +2597,11 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, epoll__add_remove);
 	ATF_TP_ADD_TC(tp, epoll__add_existing);
 	ATF_TP_ADD_TC(tp, epoll__modify_existing);
+	ATF_TP_ADD_TC(tp, epoll__modify_data_only);
+	ATF_TP_ADD_TC(tp, epoll__exclusive);
 	ATF_TP_ADD_TC(tp, epoll__modify_nonexisting);
 	ATF_TP_ADD_TC(tp, epoll__poll_only_fd);
+	ATF_TP_ADD_TC(tp, epoll__poll_only_fd_added_while_waiting);
 	ATF_TP_ADD_TC(tp, epoll__no_epollin_on_closed_empty_pipe);
 	ATF_TP_ADD_TC(tp, epoll__write_to_pipe_until_full);
 	ATF_TP_ADD_TC(tp, epoll__realtime_timer);
@@ -2116,9 +2621,16 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, epoll__epollout_on_own_shutdown);
 	ATF_TP_ADD_TC(tp, epoll__remove_closed);
 	ATF_TP_ADD_TC(tp, epoll__remove_closed_when_same_fd_open);
+	ATF_TP_ADD_TC(tp, epoll__remove_closed_from_all_instances);
 	ATF_TP_ADD_TC(tp, epoll__add_different_file_with_same_fd_value);
 	ATF_TP_ADD_TC(tp, epoll__invalid_writes);
 	ATF_TP_ADD_TC(tp, epoll__using_real_close);
+	ATF_TP_ADD_TC(tp, epoll__nested_loop);
+#ifndef __linux__
+	ATF_TP_ADD_TC(tp, epoll__ctl_batch);
+	ATF_TP_ADD_TC(tp, epoll__defer_ctl);
+	ATF_TP_ADD_TC(tp, epoll__defer_ctl_poll);
+#endif
 	ATF_TP_ADD_TC(tp, epoll__epoll_pwait);
 	ATF_TP_ADD_TC(tp, epoll__cloexec);
 	ATF_TP_ADD_TC(tp, epoll__fcntl_fl);
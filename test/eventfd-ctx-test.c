@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -277,6 +278,30 @@ ATF_TC_BODY_FD_LEAKCHECK(eventfd__write_read_semaphore, tc)
 	ATF_REQUIRE(close(efd) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(eventfd__recreate);
+ATF_TC_BODY_FD_LEAKCHECK(eventfd__recreate, tc)
+{
+	/* Descriptors may be recycled, none of their state must survive. */
+	for (unsigned int i = 0; i < 200; ++i) {
+		bool semaphore = i % 2 == 1;
+		int efd;
+		uint64_t value;
+
+		ATF_REQUIRE((efd = eventfd(i % 3,
+				 EFD_CLOEXEC | EFD_NONBLOCK |
+				     (semaphore ? EFD_SEMAPHORE : 0))) >= 0);
+
+		struct pollfd pfd = { .fd = efd, .events = POLLIN };
+		ATF_REQUIRE(poll(&pfd, 1, 0) == (i % 3 != 0 ? 1 : 0));
+
+		ATF_REQUIRE(eventfd_write(efd, 2) == 0);
+		ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+		ATF_REQUIRE(value == (semaphore ? 1 : i % 3 + 2));
+
+		ATF_REQUIRE(close(efd) == 0);
+	}
+}
+
 typedef struct {
 	int efd;
 	int signal_pipe[2];
@@ -587,6 +612,150 @@ ATF_TC_BODY_FD_LEAKCHECK(eventfd__toggle_nonblock, tc)
 	ATF_REQUIRE(close(efd) == 0);
 }
 
+typedef struct {
+	int efd;
+	int loop;
+} WriteOnesThreadArgs;
+
+static void *
+write_ones_fun(void *arg)
+{
+	WriteOnesThreadArgs *td = arg;
+
+	for (int i = 0; i < td->loop; i++) {
+		ATF_REQUIRE(eventfd_write(td->efd, 1) == 0);
+	}
+	return (NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(eventfd__threads_write_drain);
+ATF_TC_BODY_FD_LEAKCHECK(eventfd__threads_write_drain, tc)
+{
+#define THREADS 4
+#define LOOP 20000
+	pthread_t thread[THREADS];
+	WriteOnesThreadArgs td[THREADS];
+
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, efd,
+			&(struct epoll_event) {
+			    .events = EPOLLIN,
+			    .data.fd = efd,
+			}) == 0);
+
+	for (int i = 0; i < THREADS; i++) {
+		td[i].efd = efd;
+		td[i].loop = LOOP;
+		ATF_REQUIRE(pthread_create(&thread[i], NULL, /**/
+				write_ones_fun, &td[i]) == 0);
+	}
+
+	/* Readiness must never get lost while writers and the reader race
+	 * on the counter. */
+	uint64_t total = 0;
+	while (total != THREADS * LOOP) {
+		struct epoll_event event;
+		ATF_REQUIRE(epoll_wait(ep, &event, 1, 5000) == 1);
+
+		uint64_t value;
+		if (eventfd_read(efd, &value) == 0) {
+			total += value;
+		} else {
+			ATF_REQUIRE(errno == EAGAIN);
+		}
+	}
+
+	for (int i = 0; i < THREADS; i++) {
+		ATF_REQUIRE(pthread_join(thread[i], NULL) == 0);
+	}
+
+	/* ...and must not stick around after the last read. */
+	struct epoll_event event;
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+	struct pollfd pfd = { .fd = efd, .events = POLLIN };
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+	ATF_REQUIRE(close(ep) == 0);
+	ATF_REQUIRE(close(efd) == 0);
+#undef LOOP
+#undef THREADS
+}
+
+static void
+empty_signal_handler(int signo)
+{
+	(void)signo;
+}
+
+static void *
+sleep_then_signal_fun(void *arg)
+{
+	usleep(200000);
+	ATF_REQUIRE(pthread_kill(*(pthread_t *)arg, SIGUSR1) == 0);
+	return (NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(eventfd__read_interrupted);
+ATF_TC_BODY_FD_LEAKCHECK(eventfd__read_interrupted, tc)
+{
+	struct sigaction sa = { .sa_handler = empty_signal_handler };
+	struct sigaction old_sa;
+	ATF_REQUIRE(sigemptyset(&sa.sa_mask) == 0);
+	ATF_REQUIRE(sigaction(SIGUSR1, &sa, &old_sa) == 0);
+
+	int efd = eventfd(0, EFD_CLOEXEC);
+	ATF_REQUIRE(efd >= 0);
+
+	pthread_t self = pthread_self();
+	pthread_t thread;
+	ATF_REQUIRE(pthread_create(&thread, NULL, /**/
+			sleep_then_signal_fun, &self) == 0);
+
+	uint64_t value;
+	ATF_REQUIRE_ERRNO(EINTR, read(efd, &value, sizeof(value)) < 0);
+
+	ATF_REQUIRE(pthread_join(thread, NULL) == 0);
+	ATF_REQUIRE(close(efd) == 0);
+	ATF_REQUIRE(sigaction(SIGUSR1, &old_sa, NULL) == 0);
+}
+
+static void *
+blocking_read_fun(void *arg)
+{
+	uint64_t value;
+	(void)read(*(int *)arg, &value, sizeof(value));
+	return (NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(eventfd__read_cancelled);
+ATF_TC_BODY_FD_LEAKCHECK(eventfd__read_cancelled, tc)
+{
+	int efd = eventfd(0, EFD_CLOEXEC);
+	ATF_REQUIRE(efd >= 0);
+
+	pthread_t thread;
+	ATF_REQUIRE(pthread_create(&thread, NULL, /**/
+			blocking_read_fun, &efd) == 0);
+	usleep(200000);
+
+	void *result;
+	ATF_REQUIRE(pthread_cancel(thread) == 0);
+	ATF_REQUIRE(pthread_join(thread, &result) == 0);
+	ATF_REQUIRE(result == PTHREAD_CANCELED);
+
+	/* The eventfd must still be usable. */
+	uint64_t value;
+	ATF_REQUIRE(eventfd_write(efd, 1) == 0);
+	ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+	ATF_REQUIRE(value == 1);
+
+	ATF_REQUIRE(close(efd) == 0);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, eventfd__constants);
@@ -597,9 +766,12 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, eventfd__read);
 	ATF_TP_ADD_TC(tp, eventfd__write_read);
 	ATF_TP_ADD_TC(tp, eventfd__write_read_semaphore);
+	ATF_TP_ADD_TC(tp, eventfd__recreate);
 	ATF_TP_ADD_TC(tp, eventfd__threads_read);
 	ATF_TP_ADD_TC(tp, eventfd__fork);
 	ATF_TP_ADD_TC(tp, eventfd__stat);
+	ATF_TP_ADD_TC(tp, eventfd__read_interrupted);
+	ATF_TP_ADD_TC(tp, eventfd__read_cancelled);
 	/*
 	 * Following test based on:
 	 * https://raw.githubusercontent.com/cloudius-systems/osv/master/tests/tst-eventfd.cc
@@ -649,6 +821,7 @@ for the licenses and copyright statements of these projects.
 	ATF_TP_ADD_TC(tp, eventfd__threads_blocking);
 	ATF_TP_ADD_TC(tp, eventfd__epoll);
 	ATF_TP_ADD_TC(tp, eventfd__toggle_nonblock);
+	ATF_TP_ADD_TC(tp, eventfd__threads_write_drain);
 
 	return atf_no_error();
 }
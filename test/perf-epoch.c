@@ -0,0 +1,109 @@
+#include <atf-c.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <epoch.h>
+#include <rwlock.h>
+
+/*
+ * Lookups used to take the global RWLock for reading. Compare how both
+ * scale with the number of threads. The numbers are only reported.
+ */
+
+#define NR_SCALING_OPS 2000000
+
+struct scaling_data {
+	EpochDomain *domain;
+	RWLock *rwlock;
+};
+
+static void *
+scaling_epoch(void *arg)
+{
+	struct scaling_data *scaling_data = arg;
+
+	for (int i = 0; i < NR_SCALING_OPS; ++i) {
+		EpochRecord *record = epoch_enter(scaling_data->domain);
+		epoch_exit(scaling_data->domain, record);
+	}
+
+	return NULL;
+}
+
+static void *
+scaling_rwlock(void *arg)
+{
+	struct scaling_data *scaling_data = arg;
+
+	for (int i = 0; i < NR_SCALING_OPS; ++i) {
+		rwlock_lock_read(scaling_data->rwlock);
+		rwlock_unlock_read(scaling_data->rwlock);
+	}
+
+	return NULL;
+}
+
+static double
+scaling_ns_per_op(void *(*fun)(void *), struct scaling_data *scaling_data,
+    int nr_threads)
+{
+	pthread_t threads[16];
+
+	struct timespec start, end;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+	for (int i = 0; i < nr_threads; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL, /**/
+				fun, scaling_data) == 0);
+	}
+	for (int i = 0; i < nr_threads; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	return ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		   (double)(end.tv_nsec - start.tv_nsec)) /
+	    (double)NR_SCALING_OPS;
+}
+
+ATF_TC(perf_epoch__read_scaling);
+ATF_TC_HEAD(perf_epoch__read_scaling, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_epoch__read_scaling, tc)
+{
+	EpochDomain domain;
+	ATF_REQUIRE(epoch_domain_init(&domain) == 0);
+	RWLock rwlock;
+	ATF_REQUIRE(rwlock_init(&rwlock) == 0);
+
+	struct scaling_data scaling_data = {
+		.domain = &domain,
+		.rwlock = &rwlock,
+	};
+
+	for (int nr_threads = 1; nr_threads <= 16; nr_threads *= 2) {
+		fprintf(stderr,
+		    "%2d threads: epoch %.1f ns, rwlock %.1f ns per lookup "
+		    "and thread\n",
+		    nr_threads,
+		    scaling_ns_per_op(scaling_epoch, &scaling_data,
+			nr_threads),
+		    scaling_ns_per_op(scaling_rwlock, &scaling_data,
+			nr_threads));
+	}
+
+	rwlock_terminate(&rwlock);
+	epoch_domain_terminate(&domain);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, perf_epoch__read_scaling);
+
+	return atf_no_error();
+}
@@ -0,0 +1,380 @@
+#include <atf-c.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_EVENTFDS 64
+#define MAX_WAITERS 32
+
+typedef struct {
+	int ep;
+	atomic_bool stop;
+	atomic_long nr_events;
+} FanInCtx;
+
+/*
+ * Every event is answered by a write to the same eventfd, so each of the
+ * eventfds keeps producing events until the benchmark stops.
+ */
+static void *
+waiter_fun(void *arg)
+{
+	FanInCtx *ctx = arg;
+	long nr_events = 0;
+
+	while (!atomic_load(&ctx->stop)) {
+		struct epoll_event event;
+		int n = epoll_wait(ctx->ep, &event, 1, 100);
+		if (n < 0) {
+			ATF_REQUIRE(errno == EINTR);
+			continue;
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		eventfd_t value;
+		(void)eventfd_read(event.data.fd, &value);
+		ATF_REQUIRE(eventfd_write(event.data.fd, 1) == 0);
+		++nr_events;
+	}
+
+	atomic_fetch_add(&ctx->nr_events, nr_events);
+	return NULL;
+}
+
+static double
+fan_in_events_per_sec(int nr_waiters)
+{
+	FanInCtx ctx;
+	atomic_init(&ctx.stop, false);
+	atomic_init(&ctx.nr_events, 0);
+
+	ctx.ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ctx.ep >= 0);
+
+	int fds[NR_EVENTFDS];
+	for (int i = 0; i < NR_EVENTFDS; ++i) {
+		fds[i] = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+		ATF_REQUIRE(fds[i] >= 0);
+
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLET,
+			.data = { .fd = fds[i] },
+		};
+		ATF_REQUIRE(epoll_ctl(ctx.ep, EPOLL_CTL_ADD, fds[i], &event) ==
+		    0);
+	}
+
+	struct timespec start, end;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+
+	pthread_t threads[MAX_WAITERS];
+	for (int i = 0; i < nr_waiters; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL, /**/
+				waiter_fun, &ctx) == 0);
+	}
+
+	usleep(300000);
+	atomic_store(&ctx.stop, true);
+
+	for (int i = 0; i < nr_waiters; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	for (int i = 0; i < NR_EVENTFDS; ++i) {
+		ATF_REQUIRE(close(fds[i]) == 0);
+	}
+	ATF_REQUIRE(close(ctx.ep) == 0);
+
+	return (double)atomic_load(&ctx.nr_events) /
+	    ((double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+/*
+ * Many threads waiting on a single epoll fd should not be serialized. The
+ * numbers are only reported, as they are too noisy to assert on.
+ */
+
+ATF_TC(perf_fan_in__waiters);
+ATF_TC_HEAD(perf_fan_in__waiters, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "30");
+}
+ATF_TC_BODY(perf_fan_in__waiters, tc)
+{
+	for (int nr_waiters = 1; nr_waiters <= MAX_WAITERS; nr_waiters *= 2) {
+		fprintf(stderr, "%d waiters: %.0f events per second\n",
+		    nr_waiters, fan_in_events_per_sec(nr_waiters));
+	}
+}
+
+#define NR_ACCEPT_WORKERS 8
+#define NR_CONNECTIONS 200
+
+typedef struct {
+	int sock;
+	uint32_t events;
+	atomic_bool stop;
+	atomic_long nr_wakeups;
+	atomic_long nr_accepted;
+} AcceptStormCtx;
+
+static void *
+accept_worker_fun(void *arg)
+{
+	AcceptStormCtx *ctx = arg;
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	struct epoll_event event = { .events = ctx->events };
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, ctx->sock, &event) == 0);
+
+	while (!atomic_load(&ctx->stop)) {
+		int n = epoll_wait(ep, &event, 1, 100);
+		if (n < 0) {
+			ATF_REQUIRE(errno == EINTR);
+			continue;
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		atomic_fetch_add(&ctx->nr_wakeups, 1);
+
+		int conn = accept(ctx->sock, NULL, NULL);
+		if (conn >= 0) {
+			atomic_fetch_add(&ctx->nr_accepted, 1);
+			ATF_REQUIRE(close(conn) == 0);
+		} else {
+			ATF_REQUIRE(errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+	}
+
+	ATF_REQUIRE(close(ep) == 0);
+	return NULL;
+}
+
+static double
+accept_storm_wakeups_per_connection(uint32_t events)
+{
+	AcceptStormCtx ctx;
+	ctx.events = events;
+	atomic_init(&ctx.stop, false);
+	atomic_init(&ctx.nr_wakeups, 0);
+	atomic_init(&ctx.nr_accepted, 0);
+
+	ctx.sock = socket(PF_INET, SOCK_STREAM, 0);
+	ATF_REQUIRE(ctx.sock >= 0);
+	ATF_REQUIRE(fcntl(ctx.sock, F_SETFL, O_NONBLOCK) == 0);
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	ATF_REQUIRE(bind(ctx.sock, (struct sockaddr *)&addr, /**/
+			sizeof(addr)) == 0);
+	socklen_t addrlen = sizeof(addr);
+	ATF_REQUIRE(getsockname(ctx.sock, (struct sockaddr *)&addr, /**/
+			&addrlen) == 0);
+	ATF_REQUIRE(listen(ctx.sock, NR_CONNECTIONS) == 0);
+
+	pthread_t threads[NR_ACCEPT_WORKERS];
+	for (int i = 0; i < NR_ACCEPT_WORKERS; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL, /**/
+				accept_worker_fun, &ctx) == 0);
+	}
+
+	usleep(100000);
+
+	for (int i = 0; i < NR_CONNECTIONS; ++i) {
+		int client = socket(PF_INET, SOCK_STREAM, 0);
+		ATF_REQUIRE(client >= 0);
+		ATF_REQUIRE(connect(client, (struct sockaddr *)&addr, /**/
+				sizeof(addr)) == 0);
+		ATF_REQUIRE(close(client) == 0);
+
+		/* Let all wakeups for this connection happen. */
+		usleep(2000);
+	}
+
+	usleep(100000);
+	atomic_store(&ctx.stop, true);
+
+	for (int i = 0; i < NR_ACCEPT_WORKERS; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	ATF_REQUIRE(atomic_load(&ctx.nr_accepted) == NR_CONNECTIONS);
+	ATF_REQUIRE(close(ctx.sock) == 0);
+
+	return (double)atomic_load(&ctx.nr_wakeups) / NR_CONNECTIONS;
+}
+
+/*
+ * With one epoll instance per worker watching a shared listening socket,
+ * EPOLLEXCLUSIVE should wake about one worker per connection instead of
+ * all of them.
+ */
+
+ATF_TC(perf_fan_in__accept_storm);
+ATF_TC_HEAD(perf_fan_in__accept_storm, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "30");
+}
+ATF_TC_BODY(perf_fan_in__accept_storm, tc)
+{
+	fprintf(stderr, "%d workers: %.2f wakeups per connection\n",
+	    NR_ACCEPT_WORKERS, accept_storm_wakeups_per_connection(EPOLLIN));
+	fprintf(stderr,
+	    "%d workers: %.2f wakeups per connection (EPOLLEXCLUSIVE)\n",
+	    NR_ACCEPT_WORKERS,
+	    accept_storm_wakeups_per_connection(EPOLLIN | EPOLLEXCLUSIVE));
+}
+
+#define NR_ROUND_TRIPS 100000
+
+static int ping_pong_fds[2];
+
+static void *
+ping_pong_eventfd_fun(void *arg)
+{
+	(void)arg;
+
+	for (int i = 0; i < NR_ROUND_TRIPS; ++i) {
+		eventfd_t value;
+		ATF_REQUIRE(eventfd_read(ping_pong_fds[0], &value) == 0);
+		ATF_REQUIRE(eventfd_write(ping_pong_fds[1], 1) == 0);
+	}
+
+	return NULL;
+}
+
+static pthread_mutex_t ping_pong_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ping_pong_conds[2] = { PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER };
+static int ping_pong_counters[2];
+
+static void
+ping_pong_cond_handoff(int from, int to)
+{
+	(void)pthread_mutex_lock(&ping_pong_mutex);
+	++ping_pong_counters[to];
+	(void)pthread_cond_signal(&ping_pong_conds[to]);
+	while (ping_pong_counters[from] == 0) {
+		(void)pthread_cond_wait(&ping_pong_conds[from],
+		    &ping_pong_mutex);
+	}
+	--ping_pong_counters[from];
+	(void)pthread_mutex_unlock(&ping_pong_mutex);
+}
+
+static void *
+ping_pong_cond_fun(void *arg)
+{
+	(void)arg;
+
+	(void)pthread_mutex_lock(&ping_pong_mutex);
+	while (ping_pong_counters[0] == 0) {
+		(void)pthread_cond_wait(&ping_pong_conds[0], &ping_pong_mutex);
+	}
+	--ping_pong_counters[0];
+	(void)pthread_mutex_unlock(&ping_pong_mutex);
+
+	for (int i = 1; i < NR_ROUND_TRIPS; ++i) {
+		ping_pong_cond_handoff(0, 1);
+	}
+
+	(void)pthread_mutex_lock(&ping_pong_mutex);
+	++ping_pong_counters[1];
+	(void)pthread_cond_signal(&ping_pong_conds[1]);
+	(void)pthread_mutex_unlock(&ping_pong_mutex);
+
+	return NULL;
+}
+
+static double
+ping_pong_us_per_round_trip(bool use_eventfd)
+{
+	pthread_t thread;
+	struct timespec start, end;
+
+	if (use_eventfd) {
+		for (int i = 0; i < 2; ++i) {
+			ping_pong_fds[i] = eventfd(0, EFD_CLOEXEC);
+			ATF_REQUIRE(ping_pong_fds[i] >= 0);
+		}
+	}
+
+	ATF_REQUIRE(pthread_create(&thread, NULL,
+			use_eventfd ? ping_pong_eventfd_fun : ping_pong_cond_fun,
+			NULL) == 0);
+
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+	for (int i = 0; i < NR_ROUND_TRIPS; ++i) {
+		if (use_eventfd) {
+			eventfd_t value;
+			ATF_REQUIRE(eventfd_write(ping_pong_fds[0], 1) == 0);
+			ATF_REQUIRE(eventfd_read(ping_pong_fds[1], &value) == 0);
+		} else {
+			ping_pong_cond_handoff(1, 0);
+		}
+	}
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	ATF_REQUIRE(pthread_join(thread, NULL) == 0);
+
+	if (use_eventfd) {
+		for (int i = 0; i < 2; ++i) {
+			ATF_REQUIRE(close(ping_pong_fds[i]) == 0);
+		}
+	}
+
+	double elapsed = (double)(end.tv_sec - start.tv_sec) +
+	    (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	return elapsed * 1e6 / NR_ROUND_TRIPS;
+}
+
+/*
+ * Two threads hand a token back and forth through blocking eventfd reads,
+ * compared to doing the same with a bare condition variable.
+ */
+
+ATF_TC(perf_fan_in__blocking_handoff);
+ATF_TC_HEAD(perf_fan_in__blocking_handoff, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "30");
+}
+ATF_TC_BODY(perf_fan_in__blocking_handoff, tc)
+{
+	fprintf(stderr, "eventfd: %.2f us per round trip\n",
+	    ping_pong_us_per_round_trip(true));
+	fprintf(stderr, "condvar: %.2f us per round trip\n",
+	    ping_pong_us_per_round_trip(false));
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, perf_fan_in__waiters);
+	ATF_TP_ADD_TC(tp, perf_fan_in__accept_storm);
+	ATF_TP_ADD_TC(tp, perf_fan_in__blocking_handoff);
+
+	return atf_no_error();
+}
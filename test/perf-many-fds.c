@@ -1,11 +1,15 @@
 #include <atf-c.h>
 
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #define NR_EVENTFDS (20000)
 
@@ -40,9 +44,217 @@ ATF_TC_BODY(perf_many_fds__perf, tc)
 	free(eventfds);
 }
 
+static double
+ctl_churn_ns_per_op(int ep, int const *fds, long nr_fds)
+{
+	long const nr_ops = 300000;
+	uint32_t rnd = 1;
+
+	struct timespec start, end;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+
+	for (long i = 0; i < nr_ops; i += 3) {
+		rnd = rnd * 1103515245 + 12345;
+		int fd = fds[(rnd >> 8) % (uint32_t)nr_fds];
+
+		struct epoll_event event = { .events = EPOLLOUT };
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fd, &event) == 0);
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL) == 0);
+		event.events = EPOLLIN;
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event) == 0);
+	}
+
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	return ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		   (double)(end.tv_nsec - start.tv_nsec)) /
+	    (double)nr_ops;
+}
+
+/*
+ * The cost of epoll_ctl should not depend on the number of registered fds.
+ * The numbers are only reported, as they are too noisy to assert on.
+ */
+
+ATF_TC(perf_many_fds__ctl_churn);
+ATF_TC_HEAD(perf_many_fds__ctl_churn, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_many_fds__ctl_churn, tc)
+{
+	struct rlimit rl;
+	ATF_REQUIRE(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	rl.rlim_cur = rl.rlim_max;
+	(void)setrlimit(RLIMIT_NOFILE, &rl);
+	ATF_REQUIRE(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+
+	for (long nr_fds = 1000; nr_fds <= 1000000; nr_fds *= 10) {
+		if (rl.rlim_cur != RLIM_INFINITY &&
+		    (rlim_t)nr_fds + 64 > rl.rlim_cur) {
+			fprintf(stderr, "%ld fds: skipped (RLIMIT_NOFILE)\n",
+			    nr_fds);
+			break;
+		}
+
+		int ep = epoll_create1(EPOLL_CLOEXEC);
+		ATF_REQUIRE(ep >= 0);
+
+		int *fds = malloc((size_t)nr_fds * sizeof(int));
+		ATF_REQUIRE(fds);
+
+		long n = 0;
+		for (; n < nr_fds; ++n) {
+			fds[n] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (fds[n] < 0) {
+				break;
+			}
+
+			struct epoll_event event = { .events = EPOLLIN };
+			ATF_REQUIRE(
+			    epoll_ctl(ep, EPOLL_CTL_ADD, fds[n], &event) == 0);
+		}
+
+		if (n == nr_fds) {
+			fprintf(stderr, "%ld fds: %.1f ns per epoll_ctl\n",
+			    nr_fds, ctl_churn_ns_per_op(ep, fds, nr_fds));
+		} else {
+			fprintf(stderr, "%ld fds: skipped (%d)\n", nr_fds,
+			    errno);
+		}
+
+		for (long i = 0; i < n; ++i) {
+			ATF_REQUIRE(close(fds[i]) == 0);
+		}
+		free(fds);
+		ATF_REQUIRE(close(ep) == 0);
+
+		if (n != nr_fds) {
+			break;
+		}
+	}
+}
+
+#define NR_CLOSE_EPOLLFDS 64
+#define NR_CLOSE_FDS 20000
+
+/*
+ * Closing an fd should only touch the epoll instances watching it, not
+ * all of them.
+ */
+
+ATF_TC(perf_many_fds__close);
+ATF_TC_HEAD(perf_many_fds__close, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_many_fds__close, tc)
+{
+	struct rlimit rl;
+	ATF_REQUIRE(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	rl.rlim_cur = rl.rlim_max;
+	(void)setrlimit(RLIMIT_NOFILE, &rl);
+
+	int eps[NR_CLOSE_EPOLLFDS];
+	for (int i = 0; i < NR_CLOSE_EPOLLFDS; ++i) {
+		eps[i] = epoll_create1(EPOLL_CLOEXEC);
+		ATF_REQUIRE(eps[i] >= 0);
+	}
+
+	int *fds = malloc(NR_CLOSE_FDS * sizeof(int));
+	ATF_REQUIRE(fds);
+
+	long n = 0;
+	for (; n < NR_CLOSE_FDS; ++n) {
+		fds[n] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fds[n] < 0) {
+			break;
+		}
+
+		struct epoll_event event = { .events = EPOLLIN };
+		ATF_REQUIRE(epoll_ctl(eps[n % NR_CLOSE_EPOLLFDS], EPOLL_CTL_ADD,
+				fds[n], &event) == 0);
+	}
+
+	struct timespec start, end;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+	for (long i = 0; i < n; ++i) {
+		ATF_REQUIRE(close(fds[i]) == 0);
+	}
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	free(fds);
+	for (int i = 0; i < NR_CLOSE_EPOLLFDS; ++i) {
+		ATF_REQUIRE(close(eps[i]) == 0);
+	}
+
+	if (n == 0) {
+		atf_tc_skip("could not create eventfd: %d", errno);
+	}
+
+	fprintf(stderr, "%ld fds, %d epoll instances: %.1f ns per close\n", n,
+	    NR_CLOSE_EPOLLFDS,
+	    ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		(double)(end.tv_nsec - start.tv_nsec)) /
+		(double)n);
+}
+
+/*
+ * Closing fds that were never shimmed nor added to an epoll instance should
+ * cost about as much as a plain close, no matter how many other fds are
+ * being watched.
+ */
+ATF_TC(perf_many_fds__close_unrelated);
+ATF_TC_HEAD(perf_many_fds__close_unrelated, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_many_fds__close_unrelated, tc)
+{
+	long const nr_closes = 200000;
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[NR_CLOSE_EPOLLFDS];
+	for (int i = 0; i < NR_CLOSE_EPOLLFDS; ++i) {
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		ATF_REQUIRE(fds[i] >= 0);
+
+		struct epoll_event event = { .events = EPOLLIN };
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &event) == 0);
+	}
+
+	double ns_total = 0.0;
+	for (long i = 0; i < nr_closes; i += 2) {
+		int p[2];
+		ATF_REQUIRE(pipe(p) == 0);
+
+		struct timespec start, end;
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+		ATF_REQUIRE(close(p[0]) == 0);
+		ATF_REQUIRE(close(p[1]) == 0);
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+		ns_total += (double)(end.tv_sec - start.tv_sec) * 1e9 +
+		    (double)(end.tv_nsec - start.tv_nsec);
+	}
+
+	for (int i = 0; i < NR_CLOSE_EPOLLFDS; ++i) {
+		ATF_REQUIRE(close(fds[i]) == 0);
+	}
+	ATF_REQUIRE(close(ep) == 0);
+
+	fprintf(stderr, "%.1f ns per close of an unrelated fd\n",
+	    ns_total / (double)nr_closes);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, perf_many_fds__perf);
+	ATF_TP_ADD_TC(tp, perf_many_fds__ctl_churn);
+	ATF_TP_ADD_TC(tp, perf_many_fds__close);
+	ATF_TP_ADD_TC(tp, perf_many_fds__close_unrelated);
 
 	return atf_no_error();
 }
@@ -0,0 +1,312 @@
+#include <atf-c.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_SAMPLES 200
+
+static int64_t
+timespec_to_nanos(struct timespec const *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static struct timespec
+nanos_to_timespec(int64_t nanos)
+{
+	return (struct timespec) {
+		.tv_sec = nanos / 1000000000,
+		.tv_nsec = nanos % 1000000000,
+	};
+}
+
+static int64_t
+now_nanos(void)
+{
+	struct timespec ts;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+	return timespec_to_nanos(&ts);
+}
+
+static int
+compare_int64(void const *a, void const *b)
+{
+	int64_t x = *(int64_t const *)a;
+	int64_t y = *(int64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Measures how late expirations are reported by a blocking read(). The
+ * first expiration is 'value_nanos' from now, following ones are
+ * 'interval_nanos' apart.
+ */
+static void
+report_lateness(char const *mode, int64_t value_nanos, int64_t interval_nanos)
+{
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	ATF_REQUIRE(tfd >= 0);
+
+	int64_t lateness[NR_SAMPLES];
+
+	int64_t first_expiration = 0;
+	uint64_t nr_expirations = 0;
+
+	for (int i = 0; i < NR_SAMPLES; ++i) {
+		if (interval_nanos == 0 || i == 0) {
+			first_expiration = now_nanos() + value_nanos;
+			nr_expirations = 0;
+
+			struct itimerspec time = {
+				.it_value = nanos_to_timespec(first_expiration),
+				.it_interval = nanos_to_timespec(
+				    interval_nanos),
+			};
+			ATF_REQUIRE(timerfd_settime(tfd, TFD_TIMER_ABSTIME,
+					&time, NULL) == 0);
+		}
+
+		uint64_t value;
+		ATF_REQUIRE(read(tfd, &value, sizeof(value)) ==
+		    (ssize_t)sizeof(value));
+		int64_t now = now_nanos();
+
+		ATF_REQUIRE(value > 0);
+		nr_expirations += value;
+
+		int64_t last_expiration = first_expiration +
+		    (int64_t)(nr_expirations - 1) * interval_nanos;
+		lateness[i] = now - last_expiration;
+		ATF_REQUIRE(lateness[i] >= 0);
+	}
+
+	ATF_REQUIRE(close(tfd) == 0);
+
+	qsort(lateness, NR_SAMPLES, sizeof(lateness[0]), compare_int64);
+
+	fprintf(stderr,
+	    "%s: lateness p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+	    "max %.1f us\n",
+	    mode, (double)lateness[NR_SAMPLES / 2] / 1e3,
+	    (double)lateness[NR_SAMPLES * 9 / 10] / 1e3,
+	    (double)lateness[NR_SAMPLES * 99 / 100] / 1e3,
+	    (double)lateness[NR_SAMPLES - 1] / 1e3);
+}
+
+/*
+ * Timeouts that are whole milliseconds, whole microseconds and neither
+ * need different EVFILT_TIMER precisions. The numbers are only reported,
+ * as they are too noisy to assert on.
+ */
+
+ATF_TC(perf_timerfd__lateness);
+ATF_TC_HEAD(perf_timerfd__lateness, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "30");
+}
+ATF_TC_BODY(perf_timerfd__lateness, tc)
+{
+	report_lateness("1 ms one-shot", 1000000, 0);
+	report_lateness("250 us one-shot", 250000, 0);
+	report_lateness("250.5 us one-shot", 250500, 0);
+	report_lateness("250.5 us periodic", 250500, 250500);
+}
+
+#ifndef __linux__
+#define NR_SLACK_TIMERS 10000
+
+/*
+ * Arms 'NR_SLACK_TIMERS' periodic timers with staggered 10 ms periods and
+ * counts how often a single epoll_wait() loop is woken up.
+ */
+static void
+report_slack_wakeups(long slack_nanos)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+	ATF_REQUIRE(epoll_shim_set_timer_slack(ep, slack_nanos) == 0);
+
+	static int tfds[NR_SLACK_TIMERS];
+	int nr_tfds = 0;
+
+	int64_t start = now_nanos();
+
+	for (; nr_tfds < NR_SLACK_TIMERS; ++nr_tfds) {
+		int tfd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_CLOEXEC | TFD_NONBLOCK);
+		if (tfd < 0) {
+			ATF_REQUIRE(errno == EMFILE || errno == ENFILE);
+			break;
+		}
+		tfds[nr_tfds] = tfd;
+
+		ATF_REQUIRE(epoll_shim_set_timer_slack(tfd, slack_nanos) == 0);
+
+		struct itimerspec time = {
+			.it_value = nanos_to_timespec(
+			    start + 10000000 + nr_tfds * 1000),
+			.it_interval = nanos_to_timespec(10000000),
+		};
+		ATF_REQUIRE(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &time,
+				NULL) == 0);
+
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, tfd,
+				&(struct epoll_event) {
+				    .events = EPOLLIN,
+				    .data.fd = tfd,
+				}) == 0);
+	}
+
+	if (nr_tfds == 0) {
+		ATF_REQUIRE(close(ep) == 0);
+		atf_tc_skip("cannot create timerfds");
+	}
+
+	struct epoll_event events[256];
+	uint64_t nr_wakeups = 0;
+	uint64_t nr_expirations = 0;
+
+	start = now_nanos();
+	int64_t end = start + 1000000000;
+
+	for (int64_t now = start; now < end; now = now_nanos()) {
+		int n = epoll_wait(ep, events, 256,
+		    (int)((end - now + 999999) / 1000000));
+		ATF_REQUIRE(n >= 0);
+		if (n == 0) {
+			continue;
+		}
+
+		++nr_wakeups;
+		for (int i = 0; i < n; ++i) {
+			uint64_t value;
+			ATF_REQUIRE(read(events[i].data.fd, &value,
+					sizeof(value)) ==
+			    (ssize_t)sizeof(value));
+			nr_expirations += value;
+		}
+	}
+
+	for (int i = 0; i < nr_tfds; ++i) {
+		ATF_REQUIRE(close(tfds[i]) == 0);
+	}
+	ATF_REQUIRE(close(ep) == 0);
+
+	fprintf(stderr,
+	    "%d timers, slack %ld us: %llu wakeups/s, "
+	    "%llu expirations/s\n",
+	    nr_tfds, slack_nanos / 1000, (unsigned long long)nr_wakeups,
+	    (unsigned long long)nr_expirations);
+}
+#endif
+
+ATF_TC(perf_timerfd__slack_wakeups);
+ATF_TC_HEAD(perf_timerfd__slack_wakeups, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_timerfd__slack_wakeups, tc)
+{
+#ifdef __linux__
+	atf_tc_skip("epoll_shim_set_timer_slack is an epoll-shim extension");
+#else
+	report_slack_wakeups(0);
+	report_slack_wakeups(1000000);
+	report_slack_wakeups(10000000);
+#endif
+}
+
+/*
+ * Creating a timerfd per request must not stall threads that are busy
+ * reading and writing other descriptors. Reports the cost of a
+ * timerfd_create/close pair and the throughput of the readers.
+ */
+
+#define NR_BUSY_THREADS 4
+#define NR_CREATED_TIMERFDS 20000
+
+struct busy_thread_data {
+	atomic_bool *done;
+	long nr_ops;
+};
+
+static void *
+busy_thread(void *arg)
+{
+	struct busy_thread_data *data = arg;
+
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	while (!atomic_load(data->done)) {
+		eventfd_t value;
+		ATF_REQUIRE(eventfd_write(efd, 1) == 0);
+		ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+		++data->nr_ops;
+	}
+
+	ATF_REQUIRE(close(efd) == 0);
+	return NULL;
+}
+
+ATF_TC(perf_timerfd__create_while_busy);
+ATF_TC_HEAD(perf_timerfd__create_while_busy, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "60");
+}
+ATF_TC_BODY(perf_timerfd__create_while_busy, tc)
+{
+	atomic_bool done;
+	atomic_init(&done, false);
+
+	pthread_t threads[NR_BUSY_THREADS];
+	struct busy_thread_data data[NR_BUSY_THREADS];
+	for (int i = 0; i < NR_BUSY_THREADS; ++i) {
+		data[i] = (struct busy_thread_data) { .done = &done };
+		ATF_REQUIRE(pthread_create(&threads[i], NULL, /**/
+				busy_thread, &data[i]) == 0);
+	}
+
+	struct timespec start, end;
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+	for (int i = 0; i < NR_CREATED_TIMERFDS; ++i) {
+		int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		ATF_REQUIRE(tfd >= 0);
+		ATF_REQUIRE(close(tfd) == 0);
+	}
+	ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+	atomic_store(&done, true);
+	long nr_ops = 0;
+	for (int i = 0; i < NR_BUSY_THREADS; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+		nr_ops += data[i].nr_ops;
+	}
+
+	int64_t nanos = timespec_to_nanos(&end) - timespec_to_nanos(&start);
+	fprintf(stderr,
+	    "%.1f us per timerfd create/close, "
+	    "%.0f eventfd round trips per second\n",
+	    (double)nanos / 1000.0 / NR_CREATED_TIMERFDS,
+	    (double)nr_ops * 1e9 / (double)nanos);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, perf_timerfd__lateness);
+	ATF_TP_ADD_TC(tp, perf_timerfd__slack_wakeups);
+	ATF_TP_ADD_TC(tp, perf_timerfd__create_while_busy);
+
+	return atf_no_error();
+}
@@ -1,5 +1,8 @@
 #include <atf-c.h>
 
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <rwlock.h>
@@ -102,9 +105,101 @@ ATF_TC_BODY(stress, tc)
 	}
 }
 
+/*
+ * Many readers with an occasional writer. The numbers are only reported;
+ * with per-thread reader slots the cost per read lock should not grow
+ * with the number of threads.
+ */
+
+#define NR_CONTENTION_OPS 1000000
+
+struct contention_data {
+	RWLock *lock;
+	atomic_bool done;
+	int data;
+};
+
+static void *
+contention_reader(void *arg)
+{
+	struct contention_data *contention_data = arg;
+	int sum = 0;
+
+	for (int i = 0; i < NR_CONTENTION_OPS; ++i) {
+		rwlock_lock_read(contention_data->lock);
+		sum += contention_data->data;
+		rwlock_unlock_read(contention_data->lock);
+	}
+
+	return (void *)(intptr_t)sum;
+}
+
+static void *
+contention_writer(void *arg)
+{
+	struct contention_data *contention_data = arg;
+
+	while (!atomic_load(&contention_data->done)) {
+		usleep(1000);
+
+		rwlock_lock_write(contention_data->lock);
+		++contention_data->data;
+		rwlock_unlock_write(contention_data->lock);
+	}
+
+	return NULL;
+}
+
+ATF_TC(contention);
+ATF_TC_HEAD(contention, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "120");
+}
+ATF_TC_BODY(contention, tc)
+{
+	RWLock rwlock;
+	ATF_REQUIRE(rwlock_init(&rwlock) == 0);
+
+	for (int nr_threads = 1; nr_threads <= 16; nr_threads *= 2) {
+		struct contention_data contention_data = { .lock = &rwlock };
+
+		pthread_t writer;
+		ATF_REQUIRE(pthread_create(&writer, NULL, /**/
+				contention_writer, &contention_data) == 0);
+
+		struct timespec start, end;
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+
+		pthread_t threads[16];
+		for (int i = 0; i < nr_threads; ++i) {
+			ATF_REQUIRE(pthread_create(&threads[i], NULL,
+					contention_reader,
+					&contention_data) == 0);
+		}
+		for (int i = 0; i < nr_threads; ++i) {
+			ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+		}
+
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+		atomic_store(&contention_data.done, true);
+		ATF_REQUIRE(pthread_join(writer, NULL) == 0);
+
+		fprintf(stderr,
+		    "%2d readers: %.1f ns per read lock and reader\n",
+		    nr_threads,
+		    ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+			(double)(end.tv_nsec - start.tv_nsec)) /
+			(double)NR_CONTENTION_OPS);
+	}
+
+	rwlock_terminate(&rwlock);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, stress);
+	ATF_TP_ADD_TC(tp, contention);
 
 	return atf_no_error();
 }
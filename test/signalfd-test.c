@@ -188,6 +188,95 @@ ATF_TC_BODY_FD_LEAKCHECK(signalfd__multiple_signals, tcptr)
 	ATF_REQUIRE(close(sfd) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(signalfd__partial_batch_read);
+ATF_TC_BODY_FD_LEAKCHECK(signalfd__partial_batch_read, tcptr)
+{
+	sigset_t mask;
+	struct signalfd_siginfo fdsi[3];
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+
+	ATF_REQUIRE(sigprocmask(SIG_BLOCK, &mask, NULL) == 0);
+
+	int sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+	ATF_REQUIRE(sfd >= 0);
+
+	kill(getpid(), SIGINT);
+	kill(getpid(), SIGUSR1);
+	kill(getpid(), SIGUSR2);
+
+	/* Trailing bytes that do not fit a whole siginfo are ignored. */
+	ATF_REQUIRE(read(sfd, &fdsi, 2 * sizeof(fdsi[0]) + 1) ==
+	    2 * (ssize_t)sizeof(fdsi[0]));
+
+	struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 1);
+	ATF_REQUIRE(pfd.revents == POLLIN);
+
+	struct signalfd_siginfo rest[3];
+	ATF_REQUIRE(read(sfd, &rest, sizeof(rest)) ==
+	    (ssize_t)sizeof(rest[0]));
+	fdsi[2] = rest[0];
+
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+	ATF_REQUIRE_ERRNO(EAGAIN, read(sfd, &rest, sizeof(rest)) < 0);
+
+	uint32_t signos = 0;
+	for (int i = 0; i < 3; ++i) {
+		signos |= 1U << fdsi[i].ssi_signo;
+	}
+	ATF_REQUIRE(signos == ((1U << SIGINT) | (1U << SIGUSR1) | /**/
+				  (1U << SIGUSR2)));
+
+	ATF_REQUIRE(close(sfd) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(signalfd__idle_poll);
+ATF_TC_BODY_FD_LEAKCHECK(signalfd__idle_poll, tcptr)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+
+	ATF_REQUIRE(sigprocmask(SIG_BLOCK, &mask, NULL) == 0);
+
+	int sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+	ATF_REQUIRE(sfd >= 0);
+
+	struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+	}
+
+	kill(getpid(), SIGUSR1);
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 1);
+	ATF_REQUIRE(pfd.revents == POLLIN);
+
+	/* Consuming the signal elsewhere must not leave the fd readable. */
+	int signo;
+	ATF_REQUIRE(sigwait(&mask, &signo) == 0);
+	ATF_REQUIRE(signo == SIGUSR1);
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+	}
+
+	kill(getpid(), SIGUSR1);
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 1);
+	ATF_REQUIRE(pfd.revents == POLLIN);
+
+	struct signalfd_siginfo fdsi;
+	ATF_REQUIRE(read(sfd, &fdsi, sizeof(fdsi)) == (ssize_t)sizeof(fdsi));
+	ATF_REQUIRE(fdsi.ssi_signo == SIGUSR1);
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+	ATF_REQUIRE(close(sfd) == 0);
+}
+
 ATF_TC_WITHOUT_HEAD(signalfd__modify_signalmask);
 ATF_TC_BODY_FD_LEAKCHECK(signalfd__modify_signalmask, tcptr)
 {
@@ -644,6 +733,8 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, signalfd__blocking_read);
 	ATF_TP_ADD_TC(tp, signalfd__nonblocking_read);
 	ATF_TP_ADD_TC(tp, signalfd__multiple_signals);
+	ATF_TP_ADD_TC(tp, signalfd__partial_batch_read);
+	ATF_TP_ADD_TC(tp, signalfd__idle_poll);
 	ATF_TP_ADD_TC(tp, signalfd__modify_signalmask);
 	ATF_TP_ADD_TC(tp, signalfd__argument_checks);
 	ATF_TP_ADD_TC(tp, signalfd__signal_disposition);
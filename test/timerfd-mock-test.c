@@ -25,6 +25,9 @@
 
 #include <sys/timerfd.h>
 
+#ifndef __linux__
+static unsigned short evfilt_timer_flags;
+#endif
 static unsigned int evfilt_timer_fflags;
 static int64_t evfilt_timer_data;
 static int kevent_called;
@@ -51,11 +54,13 @@ kevent(int kq, const struct kevent *changelist, kevent_n_type nchanges,
 
 	if (nchanges == 1) {
 		ATF_REQUIRE(changelist[0].filter == EVFILT_TIMER);
+		evfilt_timer_flags = changelist[0].flags;
 		evfilt_timer_fflags = changelist[0].fflags;
 		evfilt_timer_data = changelist[0].data;
 	} else if (nchanges == 2) {
 		ATF_REQUIRE(changelist[0].filter == EVFILT_TIMER);
 		ATF_REQUIRE(changelist[1].filter == EVFILT_TIMER);
+		evfilt_timer_flags = changelist[1].flags;
 		evfilt_timer_fflags = changelist[1].fflags;
 		evfilt_timer_data = changelist[1].data;
 	} else {
@@ -103,6 +108,10 @@ ATF_TC_BODY(timerfd_mock__mocked_kevent, tc)
     (defined(__NetBSD__) && __NetBSD_Version__ >= 999009100)
 		if (evfilt_timer_fflags == 0) {
 			ATF_REQUIRE(evfilt_timer_data == ms);
+#ifdef NOTE_NSECONDS
+		} else if (evfilt_timer_fflags == NOTE_NSECONDS) {
+			ATF_REQUIRE(evfilt_timer_data == ms * 1000000);
+#endif
 		} else {
 			ATF_REQUIRE(evfilt_timer_fflags == NOTE_USECONDS);
 			ATF_REQUIRE(evfilt_timer_data == ms * 1000);
@@ -128,9 +137,45 @@ ATF_TC_BODY(timerfd_mock__mocked_kevent, tc)
 	ATF_REQUIRE(close(tfd) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(timerfd_mock__periodic_kevent);
+ATF_TC_BODY(timerfd_mock__periodic_kevent, tc)
+{
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	ATF_REQUIRE(tfd >= 0);
+
+	struct itimerspec time = {
+		.it_value.tv_nsec = 1000000,
+		.it_interval.tv_nsec = 1000000,
+	};
+
+	kevent_called = 0;
+
+	int r;
+	if ((r = timerfd_settime(tfd, 0, &time, NULL)) == 0) {
+		atf_tc_skip("kevent could not be mocked");
+	}
+	ATF_REQUIRE_ERRNO(ENOSYS, r < 0);
+	ATF_REQUIRE(kevent_called == 1 || kevent_called == 2);
+
+#if !defined(__linux__) && \
+    !(defined(__NetBSD__) && __NetBSD_Version__ < 999009100)
+	/* Expirations one interval apart use a repeating timer... */
+	ATF_REQUIRE((evfilt_timer_flags & EV_ADD) != 0);
+	ATF_REQUIRE((evfilt_timer_flags & EV_ONESHOT) == 0);
+
+	/* ...but a differing first expiration needs a one-shot timer. */
+	time.it_value.tv_nsec = 500000;
+	ATF_REQUIRE_ERRNO(ENOSYS, timerfd_settime(tfd, 0, &time, NULL) < 0);
+	ATF_REQUIRE((evfilt_timer_flags & EV_ONESHOT) != 0);
+#endif
+
+	ATF_REQUIRE(close(tfd) == 0);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, timerfd_mock__mocked_kevent);
+	ATF_TP_ADD_TC(tp, timerfd_mock__periodic_kevent);
 
 	return atf_no_error();
 }
@@ -1002,6 +1002,61 @@ ATF_TC_BODY_FD_LEAKCHECK(timerfd__reset_to_very_long, tc)
 	ATF_REQUIRE(errno == EAGAIN);
 }
 
+ATF_TC_WITHOUT_HEAD(timerfd__timer_slack);
+ATF_TC_BODY_FD_LEAKCHECK(timerfd__timer_slack, tc)
+{
+#ifdef __linux__
+	atf_tc_skip("epoll_shim_set_timer_slack is an epoll-shim extension");
+#else
+	int const slack_nanos = 50000000;
+
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, /**/
+	    TFD_CLOEXEC | TFD_NONBLOCK);
+	ATF_REQUIRE(timerfd >= 0);
+
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_shim_set_timer_slack(timerfd, -1) < 0);
+	ATF_REQUIRE_ERRNO(EBADF, epoll_shim_set_timer_slack(-1, 0) < 0);
+	{
+		int p[2];
+		ATF_REQUIRE(pipe(p) == 0);
+		ATF_REQUIRE_ERRNO(EINVAL,
+		    epoll_shim_set_timer_slack(p[0], 0) < 0);
+		ATF_REQUIRE(close(p[0]) == 0);
+		ATF_REQUIRE(close(p[1]) == 0);
+	}
+
+	ATF_REQUIRE(epoll_shim_set_timer_slack(timerfd, slack_nanos) == 0);
+
+	for (int i = 0; i < 3; ++i) {
+		struct timespec b;
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &b) == 0);
+
+		ATF_REQUIRE(timerfd_settime(timerfd, 0,
+				&(struct itimerspec) {
+				    .it_value.tv_nsec = 10000000,
+				},
+				NULL) == 0);
+		ATF_REQUIRE(wait_for_timerfd(timerfd) == 1);
+
+		struct timespec e;
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &e) == 0);
+
+		/* The expiration is delayed to the next multiple of the
+		 * slack. */
+		int64_t b_nanos = (int64_t)b.tv_sec * 1000000000 + b.tv_nsec +
+		    10000000;
+		int64_t boundary = (b_nanos + slack_nanos - 1) / slack_nanos *
+		    slack_nanos;
+		ATF_REQUIRE((int64_t)e.tv_sec * 1000000000 + e.tv_nsec >=
+		    boundary);
+	}
+
+	ATF_REQUIRE(epoll_shim_set_timer_slack(timerfd, 0) == 0);
+	ATF_REQUIRE(close(timerfd) == 0);
+#endif
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, timerfd__many_timers);
@@ -1023,6 +1078,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, timerfd__short_evfilt_timer_timeout);
 	ATF_TP_ADD_TC(tp, timerfd__unmodified_errno);
 	ATF_TP_ADD_TC(tp, timerfd__reset_to_very_long);
+	ATF_TP_ADD_TC(tp, timerfd__timer_slack);
 
 	return atf_no_error();
 }